@@ -22,7 +22,9 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 // SOFTWARE.
 
+#include <array>
 #include <fstream>
+#include <queue>
 #include <string>
 #include <vector>
 
@@ -30,6 +32,8 @@
 
 #include <UU/UU.h>
 
+#include "open-history.h"
+
 extern int optind;
 
 namespace fs = std::filesystem;
@@ -38,14 +42,17 @@ using UU::ANSICode;
 using UU::Size;
 using UU::Spread;
 using UU::String;
+using UU::StringView;
 using UU::TextRef;
+using UU::UInt64;
 
 enum class IncludeDirectries { No, Yes };
+enum class MatchNeedles { All, Any };
 
-static std::vector<fs::path> find_matches(const fs::path &dir, const std::vector<String> &needles, int flags, 
-    IncludeDirectries include_directories = IncludeDirectries::No)
+// Calls the visitor with every regular file under dir, and every directory too if asked
+template <typename Visitor>
+static void walk_paths(const fs::path &dir, IncludeDirectries include_directories, Visitor visitor)
 {
-    std::vector<fs::path> result;
     fs::directory_options options = fs::directory_options::skip_permission_denied;
     for (auto it = fs::recursive_directory_iterator(dir, options); it != fs::recursive_directory_iterator(); ++it) {
         const fs::directory_entry &dir_entry = *it;
@@ -61,16 +68,389 @@ static std::vector<fs::path> find_matches(const fs::path &dir, const std::vector
         else if (!dir_entry.is_regular_file()) {
             continue;
         }
+        visitor(path);
+    }
+}
+
+static std::vector<fs::path> find_matches(const fs::path &dir, const std::vector<String> &needles, int flags, 
+    IncludeDirectries include_directories = IncludeDirectries::No)
+{
+    std::vector<fs::path> result;
+    walk_paths(dir, include_directories, [&](const fs::path &path) {
         for (const auto &pattern : needles) {
             if (UU::filename_match(pattern, path, flags)) {
                 result.push_back(path);
                 break;
             }
         }
+    });
+    return result;
+}
+
+// Fuzzy matching, in the manner of fzf. A needle matches a path if its characters appear
+// in the path in order. The match is scored by where its characters land: at the start of a
+// path component or word, at a camelCase hump, or right after the previous match character
+// all earn bonuses, and gaps between match characters cost a little. Paths are first checked
+// against a bit mask of the characters they contain, which rules out most of them before
+// any scan, and only the best scoring paths are kept.
+enum class FuzzyCase { Insensitive, Sensitive };
+
+static constexpr int FuzzyScoreMatch = 16;
+static constexpr int FuzzyScoreGapStart = -3;
+static constexpr int FuzzyScoreGapExtension = -1;
+static constexpr int FuzzyBonusBoundary = FuzzyScoreMatch / 2;
+static constexpr int FuzzyBonusDelimiter = FuzzyBonusBoundary + 2;
+static constexpr int FuzzyBonusNonWord = FuzzyScoreMatch / 2;
+static constexpr int FuzzyBonusCamel123 = FuzzyBonusBoundary - 1;
+static constexpr int FuzzyBonusConsecutive = -(FuzzyScoreGapStart + FuzzyScoreGapExtension);
+static constexpr int FuzzyBonusFirstCharMultiplier = 2;
+static constexpr Size FuzzyDefaultTopCount = 50;
+static constexpr int FuzzyFrecencyWeight = FuzzyScoreMatch;
+
+enum class FuzzyCharClass { Delimiter, NonWord, Lower, Upper, Number };
+
+static FuzzyCharClass fuzzy_char_class(unsigned char c)
+{
+    if (c >= 'a' && c <= 'z') {
+        return FuzzyCharClass::Lower;
+    }
+    if (c >= 'A' && c <= 'Z') {
+        return FuzzyCharClass::Upper;
+    }
+    if (c >= '0' && c <= '9') {
+        return FuzzyCharClass::Number;
+    }
+    if (c == '/') {
+        return FuzzyCharClass::Delimiter;
+    }
+    if (c >= 0x80) {
+        // treat UTF-8 sequences as parts of words
+        return FuzzyCharClass::Lower;
+    }
+    // underscores, dashes, dots and the rest separate words, so snake_case starts get a bonus
+    return FuzzyCharClass::NonWord;
+}
+
+static int fuzzy_bonus(FuzzyCharClass prev_class, FuzzyCharClass char_class)
+{
+    bool is_word = char_class != FuzzyCharClass::Delimiter && char_class != FuzzyCharClass::NonWord;
+    if (is_word && prev_class == FuzzyCharClass::Delimiter) {
+        return FuzzyBonusDelimiter;
+    }
+    if (is_word && prev_class == FuzzyCharClass::NonWord) {
+        return FuzzyBonusBoundary;
+    }
+    if ((prev_class == FuzzyCharClass::Lower && char_class == FuzzyCharClass::Upper) ||
+        (prev_class != FuzzyCharClass::Number && char_class == FuzzyCharClass::Number)) {
+        return FuzzyBonusCamel123;
+    }
+    return is_word ? 0 : FuzzyBonusNonWord;
+}
+
+// One bit for each letter and digit, folding case, with the other bytes sharing the rest.
+// A needle can only match a path if every bit in its mask is also in the path's.
+static const std::array<UInt64, 256> &fuzzy_char_bits()
+{
+    static const std::array<UInt64, 256> bits = [] {
+        std::array<UInt64, 256> result;
+        for (int c = 0; c < 256; c++) {
+            int folded = tolower(c);
+            if (folded >= 'a' && folded <= 'z') {
+                result[c] = UInt64(1) << (folded - 'a');
+            }
+            else if (c >= '0' && c <= '9') {
+                result[c] = UInt64(1) << (26 + c - '0');
+            }
+            else {
+                result[c] = UInt64(1) << (36 + c % 28);
+            }
+        }
+        return result;
+    }();
+    return bits;
+}
+
+static UInt64 fuzzy_char_mask(StringView text)
+{
+    const std::array<UInt64, 256> &bits = fuzzy_char_bits();
+    UInt64 mask = 0;
+    for (unsigned char c : text) {
+        mask |= bits[c];
+    }
+    return mask;
+}
+
+class FuzzyNeedle
+{
+public:
+    FuzzyNeedle(const String &needle, FuzzyCase fuzzy_case) : m_mask(fuzzy_char_mask(needle)) {
+        // each needle character matches itself, and its other case too when case doesn't matter
+        for (unsigned char c : needle) {
+            m_chars.push_back(c);
+            m_other_case_chars.push_back(fuzzy_case == FuzzyCase::Insensitive && isalpha(c) ? c ^ 0x20 : c);
+        }
+    }
+
+    bool might_match(UInt64 text_mask) const { return (m_mask & ~text_mask) == 0; }
+
+    // Scores the best match of the needle in the text, returning false if there is none.
+    // A forward scan finds the earliest place each needle character can match, which rules
+    // out texts that don't hold the needle and bounds the search. Then the best alignment
+    // of the needle is found by dynamic programming over the stretch of text from the first
+    // match character to the last place the last needle character appears. If positions
+    // is given, it gets the offsets of the matched characters.
+    bool score(StringView text, int &score, std::vector<Size> *positions = nullptr) const {
+        const Size needle_length = m_chars.size();
+        score = 0;
+        if (needle_length == 0) {
+            return true;
+        }
+        m_firsts.clear();
+        for (Size idx = 0; idx < text.length() && m_firsts.size() < needle_length; idx++) {
+            if (is_match(text[idx], m_firsts.size())) {
+                m_firsts.push_back(idx);
+            }
+        }
+        if (m_firsts.size() < needle_length) {
+            return false;
+        }
+        Size last = text.length() - 1;
+        while (!is_match(text[last], needle_length - 1)) {
+            last--;
+        }
+        const Size start = m_firsts[0];
+        const Size width = last - start + 1;
+
+        m_bonuses.resize(width);
+        FuzzyCharClass prev_class = start > 0 ? fuzzy_char_class(text[start - 1]) : FuzzyCharClass::Delimiter;
+        for (Size col = 0; col < width; col++) {
+            FuzzyCharClass char_class = fuzzy_char_class(text[start + col]);
+            m_bonuses[col] = fuzzy_bonus(prev_class, char_class);
+            prev_class = char_class;
+        }
+
+        // scores[row * width + col] is the best score with needle character row matched
+        // at or before col, and runs[row * width + col] the length of the run of consecutive
+        // matches ending there, zero if col isn't matched
+        m_scores.assign(needle_length * width, 0);
+        m_runs.assign(needle_length * width, 0);
+        int best_score = 0;
+        Size best_col = 0;
+        for (Size row = 0; row < needle_length; row++) {
+            int *scores = m_scores.data() + row * width;
+            int *runs = m_runs.data() + row * width;
+            const Size first_col = m_firsts[row] - start;
+            bool in_gap = false;
+            for (Size col = first_col; col < width; col++) {
+                bool matches = is_match(text[start + col], row);
+                int left = col > first_col ? scores[col - 1] : 0;
+                int gap_score = left + (in_gap ? FuzzyScoreGapExtension : FuzzyScoreGapStart);
+                int match_score = 0;
+                int run = 0;
+                if (matches && row == 0) {
+                    match_score = FuzzyScoreMatch + m_bonuses[col] * FuzzyBonusFirstCharMultiplier;
+                    gap_score = 0;
+                    run = 1;
+                }
+                else if (matches) {
+                    int bonus = m_bonuses[col];
+                    // the previous row's first match is before this one's, so col is at least 1
+                    const Size diagonal = (row - 1) * width + col - 1;
+                    match_score = m_scores[diagonal] + FuzzyScoreMatch;
+                    run = m_runs[diagonal] + 1;
+                    if (run > 1) {
+                        // a run of consecutive matches keeps the bonus of the boundary it started on,
+                        // unless a better boundary starts a new run
+                        int first_bonus = m_bonuses[col - run + 1];
+                        if (bonus >= FuzzyBonusBoundary && bonus > first_bonus) {
+                            run = 1;
+                        }
+                        else {
+                            bonus = std::max(std::max(bonus, first_bonus), FuzzyBonusConsecutive);
+                        }
+                    }
+                    if (match_score + bonus < gap_score) {
+                        match_score += m_bonuses[col];
+                        run = 0;
+                    }
+                    else {
+                        match_score += bonus;
+                    }
+                }
+                runs[col] = run;
+                in_gap = match_score < gap_score;
+                scores[col] = std::max(std::max(match_score, gap_score), 0);
+                if (row == needle_length - 1 && matches && scores[col] > best_score) {
+                    best_score = scores[col];
+                    best_col = col;
+                }
+            }
+        }
+        score = best_score;
+        if (!positions) {
+            return true;
+        }
+
+        // trace back from the best score, preferring to extend runs of consecutive matches
+        Size positions_start = positions->size();
+        Size row = needle_length - 1;
+        Size col = best_col;
+        bool prefer_match = true;
+        for (;;) {
+            const Size index = row * width + col;
+            const Size first_col = m_firsts[row] - start;
+            int cell_score = m_scores[index];
+            int diagonal_score = row > 0 && col > first_col ? m_scores[index - width - 1] : 0;
+            int left_score = col > first_col ? m_scores[index - 1] : 0;
+            if (cell_score > diagonal_score && (cell_score > left_score || (cell_score == left_score && prefer_match))) {
+                positions->push_back(start + col);
+                if (row == 0) {
+                    break;
+                }
+                row--;
+            }
+            prefer_match = m_runs[index] > 1 || (index + width + 1 < m_runs.size() && m_runs[index + width + 1] > 0);
+            col--;
+        }
+        std::reverse(positions->begin() + positions_start, positions->end());
+        return true;
+    }
+
+private:
+    bool is_match(unsigned char c, Size idx) const { return c == m_chars[idx] || c == m_other_case_chars[idx]; }
+
+    UInt64 m_mask;
+    std::vector<unsigned char> m_chars;
+    std::vector<unsigned char> m_other_case_chars;
+    mutable std::vector<Size> m_firsts;
+    mutable std::vector<int> m_bonuses;
+    mutable std::vector<int> m_scores;
+    mutable std::vector<int> m_runs;
+};
+
+// Scores the text against all the needles, or the best of them when any one will do
+static bool fuzzy_score(const std::vector<FuzzyNeedle> &needles, StringView text, MatchNeedles match_needles,
+    int &score, std::vector<Size> *positions = nullptr)
+{
+    UInt64 text_mask = fuzzy_char_mask(text);
+    bool matched = false;
+    score = 0;
+    for (const auto &needle : needles) {
+        int needle_score = 0;
+        if (!needle.might_match(text_mask) || !needle.score(text, needle_score, positions)) {
+            if (match_needles == MatchNeedles::All) {
+                return false;
+            }
+            continue;
+        }
+        score = match_needles == MatchNeedles::All ? score + needle_score :
+            (matched ? std::max(score, needle_score) : needle_score);
+        matched = true;
+    }
+    return matched;
+}
+
+struct FuzzyMatch
+{
+    int score;
+    fs::path path;
+};
+
+// Better matches score higher. Ties go to the shorter path, then to the path that sorts first.
+static bool is_better_fuzzy_match(const FuzzyMatch &a, const FuzzyMatch &b)
+{
+    if (a.score != b.score) {
+        return a.score > b.score;
+    }
+    if (a.path.native().length() != b.path.native().length()) {
+        return a.path.native().length() < b.path.native().length();
+    }
+    return a.path < b.path;
+}
+
+// Files opened often and lately score higher, by about one match character for each
+// doubling of their frecency
+static int fuzzy_frecency_bonus(double frecency)
+{
+    return int(FuzzyFrecencyWeight * std::log2(1 + frecency));
+}
+
+// Returns the best matches, best first. The paths are scored relative to dir, and the
+// worst of the best seen so far sits on top of a bounded heap, so each path that
+// doesn't make the cut costs one comparison. A path is only looked up in the history
+// if its frecency could lift it into the heap.
+static std::vector<fs::path> find_fuzzy_matches(const fs::path &dir, const std::vector<String> &needle_strings,
+    MatchNeedles match_needles, FuzzyCase fuzzy_case, Size top_count, IncludeDirectries include_directories,
+    const OpenHistory &history)
+{
+    const int max_frecency_bonus = fuzzy_frecency_bonus(history.max_frecency());
+    std::vector<FuzzyNeedle> needles;
+    for (const auto &needle : needle_strings) {
+        needles.emplace_back(needle, fuzzy_case);
+    }
+    std::priority_queue<FuzzyMatch, std::vector<FuzzyMatch>, decltype(&is_better_fuzzy_match)> best(is_better_fuzzy_match);
+    const Size prefix_length = dir.native().length() + 1;
+    walk_paths(dir, include_directories, [&](const fs::path &path) {
+        StringView text = path.native();
+        if (text.length() > prefix_length) {
+            text = text.substr(prefix_length);
+        }
+        int score = 0;
+        if (!fuzzy_score(needles, text, match_needles, score)) {
+            return;
+        }
+        bool is_full = best.size() == top_count;
+        if (max_frecency_bonus > 0 && (!is_full || score + max_frecency_bonus >= best.top().score)) {
+            score += fuzzy_frecency_bonus(history.frecency(path));
+        }
+        if (is_full) {
+            if (score < best.top().score) {
+                return;
+            }
+            FuzzyMatch match = { score, path };
+            if (!is_better_fuzzy_match(match, best.top())) {
+                return;
+            }
+            best.pop();
+            best.push(std::move(match));
+        }
+        else {
+            best.push({ score, path });
+        }
+    });
+    std::vector<fs::path> result(best.size());
+    for (Size idx = result.size(); idx > 0; idx--) {
+        result[idx - 1] = best.top().path;
+        best.pop();
     }
     return result;
 }
 
+// Highlights the matched characters in the last scored_length characters of the match,
+// which are the text the path was scored as
+static void add_fuzzy_highlight(TextRef &ref, const String &match, Size scored_length,
+    const std::vector<String> &needle_strings, MatchNeedles match_needles, FuzzyCase fuzzy_case)
+{
+    std::vector<FuzzyNeedle> needles;
+    for (const auto &needle : needle_strings) {
+        needles.emplace_back(needle, fuzzy_case);
+    }
+    Size offset = match.length() > scored_length ? match.length() - scored_length : 0;
+    std::vector<Size> positions;
+    int score = 0;
+    if (!fuzzy_score(needles, StringView(match).substr(offset), match_needles, score, &positions)) {
+        return;
+    }
+    Spread<Size> spread;
+    for (Size pos : positions) {
+        spread.add(offset + pos + 1, offset + pos + 2);
+    }
+    if (spread.is_empty<false>()) {
+        spread.simplify();
+        ref.add_spread(spread);
+    }
+}
+
 static void add_highlight(TextRef &ref, const String &match, const std::vector<String> &needles) 
 {
     Spread<Size> spread;
@@ -110,11 +490,16 @@ static void usage(void)
     puts("    -e : Matches must be exact.");
     puts("    -f : Prints full paths of matched files to stdout.");
     puts("    -h : Prints this help message.");
+    puts("    -k <count> : With -z, keeps the best <count> matches. Defaults to 50.");
     puts("    -o : Opens matched files with progam name given, defaults to ENV['EDIT_OPENER'].");
+    puts("         Opened files are recorded in ENV['REFS_HISTORY_PATH'] (default: ~/.refs-history),");
+    puts("         and files opened often and lately are listed first.");
     puts("    -p : Write filenames to stdout without numbers; good for piping results to other programs");
     puts("    -r : Writes numbered file references to ENV['REFS_PATH'].");
     puts("    -i : Case sensitive search.");
     puts("    -v : Prints the program version.");
+    puts("    -z : Fuzzy matching. Paths match if they have the characters of every pattern in order,");
+    puts("         and print best match first.");
     puts("    -1 : Stop at first match found.");
 }
 
@@ -126,11 +511,13 @@ static struct option long_options[] =
     {"exact",            no_argument,       0, 'e'},
     {"full path",        no_argument,       0, 'f'},
     {"help",             no_argument,       0, 'h'},
+    {"top",              required_argument, 0, 'k'},
     {"open",             optional_argument, 0, 'o'},
     {"pipe",             no_argument,       0, 'p'},
     {"refs",             no_argument,       0, 'r'},
     {"case-sensitive",   no_argument,       0, 's'},
     {"version",          no_argument,       0, 'v'},
+    {"fuzzy",            no_argument,       0, 'z'},
     {"one match",        no_argument,       0, '1'},
     {0, 0, 0, 0}
 };
@@ -145,14 +532,16 @@ int main(int argc, char *argv[])
     bool option_p = false;
     bool option_r = false;
     bool option_s = false;
+    bool option_z = false;
     bool option_1 = false;
+    Size top_count = FuzzyDefaultTopCount;
 
     String option_c;
     String opener;
 
     while (1) {
         int option_index = 0;
-        int c = getopt_long(argc, argv, "ac:defho:prsv1", long_options, &option_index);
+        int c = getopt_long(argc, argv, "ac:defhk:o:prsvz1", long_options, &option_index);
         if (c == -1)
             break;
         switch (c) {
@@ -174,6 +563,16 @@ int main(int argc, char *argv[])
             case 'h':
                 usage();
                 return 0;            
+            case 'k': {
+                char *end = nullptr;
+                long count = strtol(optarg, &end, 10);
+                if (end == optarg || *end != '\0' || count <= 0) {
+                    std::cerr << "*** match: -k needs a positive count: " << optarg << std::endl;
+                    exit(-1);
+                }
+                top_count = count;
+                break;
+            }
             case 'o':
                 option_o = true;
                 if (argv[optind] != nullptr && optarg != nullptr && optarg[0] != '-') {
@@ -192,6 +591,9 @@ int main(int argc, char *argv[])
             case 'v':
                 version();
                 return 0;            
+            case 'z':
+                option_z = true;
+                break;
             case '1':
                 option_1 = true;
                 break;            
@@ -225,61 +627,93 @@ int main(int argc, char *argv[])
 
     IncludeDirectries include_directories = option_d ? IncludeDirectries::Yes : IncludeDirectries::No;
 
-    int loop_end = option_a ? argc : optind + 1;
+    OpenHistory history;
+    history.load();
 
-    for (int i = optind; i < loop_end; i++) {
-        String str(argv[i]);
-        if (str.length() == 0) {
-            continue;
+    MatchNeedles match_needles = option_a ? MatchNeedles::Any : MatchNeedles::All;
+    FuzzyCase fuzzy_case = option_s ? FuzzyCase::Sensitive : FuzzyCase::Insensitive;
+
+    if (option_z) {
+        // fuzzy patterns aren't paths, so they're all matched against the paths under the current directory
+        for (int i = optind; i < argc; i++) {
+            if (strlen(argv[i]) > 0) {
+                all_needles.push_back(argv[i]);
+            }
         }
+        matches = find_fuzzy_matches(cwd, all_needles, match_needles, fuzzy_case, top_count, include_directories,
+            history);
+    }
+    else {
+        int loop_end = option_a ? argc : optind + 1;
 
-        fs::path path = str.c_str();
+        for (int i = optind; i < loop_end; i++) {
+            String str(argv[i]);
+            if (str.length() == 0) {
+                continue;
+            }
 
-        // determine directory
-        if (path.is_absolute()) {
-            dir = path;
-        }
-        else if (str.find_first_of('/') != String::npos) {
-            dir = fs::relative(cwd, path);
-        }
-        else {
-            dir = cwd;
-        }
-        needles.push_back(str);
-        all_needles.push_back(str);
+            fs::path path = str.c_str();
 
-        // add to pattern list
-        if (!prevdir.empty()) {
-            prevdir = dir;
+            // determine directory
+            if (path.is_absolute()) {
+                dir = path;
+            }
+            else if (str.find_first_of('/') != String::npos) {
+                dir = fs::relative(cwd, path);
+            }
+            else {
+                dir = cwd;
+            }
+            needles.push_back(str);
+            all_needles.push_back(str);
+
+            // add to pattern list
+            if (!prevdir.empty()) {
+                prevdir = dir;
+            }
+            else if (dir != prevdir) {
+                std::vector<fs::path> submatches(find_matches(dir, needles, filename_match_flags, include_directories));
+                matches.insert(matches.end(), submatches.begin(), submatches.end());
+                prevdir = dir;
+                needles.clear();
+            }
         }
-        else if (dir != prevdir) {
+
+        if (needles.size()) {
             std::vector<fs::path> submatches(find_matches(dir, needles, filename_match_flags, include_directories));
             matches.insert(matches.end(), submatches.begin(), submatches.end());
-            prevdir = dir;
-            needles.clear();
         }
-    }
 
-    if (needles.size()) {
-        std::vector<fs::path> submatches(find_matches(dir, needles, filename_match_flags, include_directories));
-        matches.insert(matches.end(), submatches.begin(), submatches.end());
-    }
+        // search within previously found matches if needed
+        if (!option_a) {
+            for (int i = loop_end; i < argc; i++) {
+                if (matches.size() == 0) {
+                    break;
+                }
+                String pattern = argv[i];
+                all_needles.push_back(pattern);
+                std::vector<fs::path> filtered_matches;
+                for (const auto &match : matches) {
+                    if (UU::filename_match(pattern, match, filename_match_flags)) {
+                        filtered_matches.push_back(match);
+                    }
+                }
+                matches = filtered_matches;
+            }
+        }
 
-    // search within previously found matches if needed
-    if (!option_a) {
-        for (int i = loop_end; i < argc; i++) {
-            if (matches.size() == 0) {
-                break;
+        // files opened often and lately come first, the rest stay in walk order
+        if (!history.is_empty()) {
+            std::vector<std::pair<double, fs::path>> ranked;
+            for (auto &match : matches) {
+                ranked.emplace_back(history.frecency(match), std::move(match));
             }
-            String pattern = argv[i];
-            all_needles.push_back(pattern);
-            std::vector<fs::path> filtered_matches;
-            for (const auto &match : matches) {
-                if (UU::filename_match(pattern, match, filename_match_flags)) {
-                    filtered_matches.push_back(match);
-                }
+            std::stable_sort(ranked.begin(), ranked.end(), [](const auto &a, const auto &b) {
+                return a.first > b.first;
+            });
+            for (Size idx = 0; idx < ranked.size(); idx++) {
+                matches[idx] = std::move(ranked[idx].second);
             }
-            matches = filtered_matches;
         }
     }
 
@@ -300,18 +734,26 @@ int main(int argc, char *argv[])
     for (const auto &match : matches) {
         index++;
         TextRef ref(index, match);
+        // fuzzy matches are all under cwd, and were scored as paths relative to it
+        Size scored_length = option_z ? match.native().length() - cwd.native().length() - 1 : 0;
 
         file_out << ref.to_string(TextRef::Index | TextRef::Filename, TextRef::FilenameFormat::ABSOLUTE) << std::endl;
         if (option_f) {
             String string_match = fs::absolute(match);
-            if (option_c.length()) {
+            if (option_c.length() && option_z) {
+                add_fuzzy_highlight(ref, string_match, scored_length, all_needles, match_needles, fuzzy_case);
+            }
+            else if (option_c.length()) {
                 add_highlight(ref, string_match, all_needles);
             }
             std::cout << ref.to_string(feature_flags, TextRef::FilenameFormat::ABSOLUTE, cwd, highlight_color) << match_ending;
         }
         else {
             String string_match = fs::relative(match);
-            if (option_c.length()) {
+            if (option_c.length() && option_z) {
+                add_fuzzy_highlight(ref, string_match, scored_length, all_needles, match_needles, fuzzy_case);
+            }
+            else if (option_c.length()) {
                 add_highlight(ref, string_match, all_needles);
             }
             std::cout << ref.to_string(feature_flags, TextRef::FilenameFormat::RELATIVE, cwd, highlight_color) << match_ending;
@@ -341,6 +783,7 @@ int main(int argc, char *argv[])
         for (const auto &match : matches) { 
             exec_args.push_back(match.c_str());
         }
+        OpenHistory::record(matches);
         int rc = UU::launch(opener, exec_args);
         std::cerr << "*** match: exec error: " << strerror(errno) << ": " << opener << std::endl;
         return rc;
@@ -0,0 +1,219 @@
+//
+// open-history.h
+//
+// MIT License
+// Copyright (c) 2022-2023 Ken Kocienda. All rights reserved.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef OPEN_HISTORY_H
+#define OPEN_HISTORY_H
+
+#include <chrono>
+#include <cmath>
+#include <filesystem>
+#include <memory>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <UU/UU.h>
+
+// A record of the files opened through match -o and ref, used to rank the files most
+// likely wanted first. The history is a small fixed-size hash table in a file, keyed by
+// a hash of each file's absolute path. Each slot holds a count of opens that decays with
+// a half-life of a week, and the time it was last brought up to date, so the frecency of
+// a file is its count decayed to now. When the slots a path can go in are all taken, the
+// one with the lowest frecency gives way. The file is named by ENV['REFS_HISTORY_PATH'],
+// defaulting to ~/.refs-history.
+class OpenHistory
+{
+public:
+    static constexpr char Magic[8] = { 'R', 'E', 'F', 'S', 'H', 'I', 'S', '1' };
+    static constexpr UU::UInt32 SlotCount = 2048;
+    static constexpr UU::Size ProbeCount = 8;
+    static constexpr double HalfLifeSeconds = 7 * 24 * 60 * 60;
+
+    struct Header
+    {
+        char magic[8];
+        UU::UInt32 slot_count;
+        UU::UInt32 reserved;
+    };
+
+    struct Slot
+    {
+        UU::UInt64 hash;
+        float count;
+        UU::UInt32 time;
+    };
+
+    static constexpr UU::Size FileLength = sizeof(Header) + SlotCount * sizeof(Slot);
+
+    static std::filesystem::path default_path() {
+        const char *path = getenv("REFS_HISTORY_PATH");
+        if (path && path[0]) {
+            return path;
+        }
+        const char *home = getenv("HOME");
+        return home && home[0] ? std::filesystem::path(home) / ".refs-history" : std::filesystem::path();
+    }
+
+    // Maps the history for lookups. A missing or unreadable history is empty.
+    bool load(const std::filesystem::path &path = default_path()) {
+        if (path.empty() || !std::filesystem::exists(path)) {
+            return false;
+        }
+        m_mapped_file = std::make_unique<UU::MappedFile>(path);
+        if (m_mapped_file->is_valid<false>() || m_mapped_file->file_length() != FileLength) {
+            m_mapped_file.reset();
+            return false;
+        }
+        const Header *header = (const Header *)m_mapped_file->base();
+        if (memcmp(header->magic, Magic, sizeof(Magic)) != 0 || header->slot_count != SlotCount) {
+            m_mapped_file.reset();
+            return false;
+        }
+        m_slots = (const Slot *)(header + 1);
+        m_now = now();
+        m_max_frecency = 0;
+        for (UU::UInt32 idx = 0; idx < SlotCount; idx++) {
+            if (m_slots[idx].hash) {
+                m_max_frecency = std::max(m_max_frecency, decayed(m_slots[idx], m_now));
+            }
+        }
+        return true;
+    }
+
+    bool is_empty() const { return m_max_frecency == 0; }
+
+    // The highest frecency of any file, which bounds what a lookup can return
+    double max_frecency() const { return m_max_frecency; }
+
+    double frecency(const std::filesystem::path &path) const {
+        if (is_empty()) {
+            return 0;
+        }
+        UU::UInt64 hash = path_hash(path);
+        for (UU::Size probe = 0; probe < ProbeCount; probe++) {
+            const Slot &slot = m_slots[(hash + probe) % SlotCount];
+            if (slot.hash == hash) {
+                return decayed(slot, m_now);
+            }
+            if (slot.hash == 0) {
+                break;
+            }
+        }
+        return 0;
+    }
+
+    // Adds an open of each path to the history, creating it if needed. The file
+    // is locked while it's changed, since several opens can race.
+    static bool record(const std::vector<std::filesystem::path> &paths, const std::filesystem::path &path = default_path()) {
+        if (path.empty() || paths.empty()) {
+            return false;
+        }
+        int fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+        if (fd < 0) {
+            return false;
+        }
+        if (flock(fd, LOCK_EX) != 0) {
+            close(fd);
+            return false;
+        }
+        struct stat stat_buf;
+        bool is_new = fstat(fd, &stat_buf) != 0 || UU::Size(stat_buf.st_size) != FileLength;
+        if (is_new && ftruncate(fd, 0) != 0) {
+            close(fd);
+            return false;
+        }
+        if (is_new && ftruncate(fd, FileLength) != 0) {
+            close(fd);
+            return false;
+        }
+        void *base = mmap(nullptr, FileLength, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (base == MAP_FAILED) {
+            close(fd);
+            return false;
+        }
+        Header *header = (Header *)base;
+        if (is_new || memcmp(header->magic, Magic, sizeof(Magic)) != 0 || header->slot_count != SlotCount) {
+            memset(base, 0, FileLength);
+            memcpy(header->magic, Magic, sizeof(Magic));
+            header->slot_count = SlotCount;
+        }
+        Slot *slots = (Slot *)(header + 1);
+        UU::UInt32 time = now();
+        for (const auto &opened : paths) {
+            add_open(slots, path_hash(opened), time);
+        }
+        munmap(base, FileLength);
+        close(fd);
+        return true;
+    }
+
+    // Hashes the absolute path of a file, never to zero, which marks an empty slot
+    static UU::UInt64 path_hash(const std::filesystem::path &path) {
+        std::error_code error;
+        std::filesystem::path absolute_path = std::filesystem::absolute(path, error).lexically_normal();
+        UU::UInt64 hash = 0xcbf29ce484222325;
+        for (unsigned char c : std::string_view(absolute_path.native())) {
+            hash = (hash ^ c) * 0x100000001b3;
+        }
+        return hash ? hash : 1;
+    }
+
+private:
+    static UU::UInt32 now() {
+        auto seconds = std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch());
+        return UU::UInt32(seconds.count());
+    }
+
+    static double decayed(const Slot &slot, UU::UInt32 time) {
+        double age = time > slot.time ? double(time - slot.time) : 0;
+        return slot.count * std::exp2(-age / HalfLifeSeconds);
+    }
+
+    static void add_open(Slot *slots, UU::UInt64 hash, UU::UInt32 time) {
+        Slot *victim = nullptr;
+        for (UU::Size probe = 0; probe < ProbeCount; probe++) {
+            Slot &slot = slots[(hash + probe) % SlotCount];
+            if (slot.hash == hash) {
+                slot.count = float(decayed(slot, time) + 1);
+                slot.time = time;
+                return;
+            }
+            if (!victim || (victim->hash && (!slot.hash || decayed(slot, time) < decayed(*victim, time)))) {
+                victim = &slot;
+            }
+        }
+        *victim = { hash, 1, time };
+    }
+
+    std::unique_ptr<UU::MappedFile> m_mapped_file;
+    const Slot *m_slots = nullptr;
+    UU::UInt32 m_now = 0;
+    double m_max_frecency = 0;
+};
+
+#endif // OPEN_HISTORY_H
@@ -22,10 +22,12 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 // SOFTWARE.
 
+#include <algorithm>
 #include <format>
 #include <fstream>
 #include <iostream>
 #include <filesystem>
+#include <map>
 #include <string>
 #include <vector>
 
@@ -33,6 +35,8 @@
 
 #include <UU/UU.h>
 
+#include "open-history.h"
+
 using UU::MappedFile;
 using UU::Size;
 using UU::Spread;
@@ -55,14 +59,151 @@ static void usage(void)
     puts("Usage: ref [options] [number]...");
     puts("");
     puts("Options:");
+    puts("    -a <file> : Applies edits to the referenced files, given a copy of the refs file with the line");
+    puts("             content of some refs changed. Each line must still match the refs file before any");
+    puts("             file is changed.");
     puts("    -f : Reads refs from given file (default: ENV['REF_PATH']).");
     puts("    -h : Prints this help message.");
     puts("    -o : Opens refs with progam name given (default: ENV['EDIT_OPENER']).");
+    puts("         Opened files are recorded in ENV['REFS_HISTORY_PATH'] (default: ~/.refs-history),");
+    puts("         so match lists them first.");
     puts("    -v : Prints the program version.");
 }
 
+// Reads every ref in a refs file, in file order
+static bool read_refs(const std::filesystem::path &path, std::vector<TextRef> &refs)
+{
+    MappedFile file(path);
+    if (file.is_valid<false>()) {
+        return false;
+    }
+    StringView string_view((char *)file.base(), file.file_length());
+    std::vector<Size> line_end_offsets = UU::find_line_end_offsets(string_view);
+    for (Size line = 1; line <= line_end_offsets.size(); line++) {
+        StringView line_view = UU::string_view_for_line(string_view, line_end_offsets, line);
+        if (line_view.length() > 0) {
+            refs.push_back(TextRef::from_string(String(line_view)));
+        }
+    }
+    return true;
+}
+
+// One line to change, along with the text it has to have before it's changed
+struct LineEdit
+{
+    Size line;
+    String original;
+    String replacement;
+};
+
+// Applies the line content edited in a copy of the refs file. Edits are matched to the
+// original refs by index, then grouped by file. Every line is checked against its original
+// text before anything is written, and each file is written once with all its edits.
+static int apply_edits(const std::filesystem::path &refs_path, const std::filesystem::path &edits_path)
+{
+    std::vector<TextRef> refs;
+    if (!read_refs(refs_path, refs)) {
+        std::cerr << "*** ref: unable to open refs file: " << refs_path << std::endl;
+        return -1;
+    }
+    std::vector<TextRef> edited_refs;
+    if (!read_refs(edits_path, edited_refs)) {
+        std::cerr << "*** ref: unable to open edited refs file: " << edits_path << std::endl;
+        return -1;
+    }
+
+    std::map<int, const TextRef *> refs_by_index;
+    for (const auto &ref : refs) {
+        refs_by_index[ref.index()] = &ref;
+    }
+
+    int errors = 0;
+    std::map<std::filesystem::path, std::vector<LineEdit>> file_edits;
+    for (const auto &edited_ref : edited_refs) {
+        auto it = refs_by_index.find(edited_ref.index());
+        if (it == refs_by_index.end()) {
+            std::cerr << "*** no such ref: " << edited_ref.index() << std::endl;
+            errors++;
+            continue;
+        }
+        const TextRef &ref = *it->second;
+        if (ref.filename() != edited_ref.filename() || ref.line() != edited_ref.line() || ref.line() == 0) {
+            std::cerr << "*** ref: only line content can be edited: " << edited_ref << std::endl;
+            errors++;
+            continue;
+        }
+        if (ref.message() == edited_ref.message()) {
+            continue;
+        }
+        file_edits[ref.filename()].push_back({ ref.line(), ref.message(), edited_ref.message() });
+    }
+
+    // make the new contents of each file, holding them until every file has been checked
+    std::vector<std::pair<std::filesystem::path, String>> outputs;
+    Size edit_count = 0;
+    for (auto &[filename, edits] : file_edits) {
+        MappedFile file(filename);
+        if (file.is_valid<false>()) {
+            std::cerr << "*** ref: unable to open file: " << filename << std::endl;
+            errors++;
+            continue;
+        }
+        StringView source((char *)file.base(), file.file_length());
+        std::vector<Size> line_end_offsets = UU::find_line_end_offsets(source);
+
+        // the same line can have more than one ref, but they all have to agree on the edit
+        std::stable_sort(edits.begin(), edits.end(), [](const LineEdit &a, const LineEdit &b) {
+            return a.line < b.line;
+        });
+        String output;
+        output.reserve(source.length());
+        Size source_index = 0;
+        for (Size idx = 0; idx < edits.size(); idx++) {
+            const LineEdit &edit = edits[idx];
+            if (idx > 0 && edits[idx - 1].line == edit.line) {
+                if (edits[idx - 1].replacement != edit.replacement) {
+                    std::cerr << "*** ref: conflicting edits: " << filename.string() << ":" << edit.line << std::endl;
+                    errors++;
+                }
+                continue;
+            }
+            if (edit.line > line_end_offsets.size()) {
+                std::cerr << "*** ref: no such line: " << filename.string() << ":" << edit.line << std::endl;
+                errors++;
+                continue;
+            }
+            StringView line_view = UU::string_view_for_line(source, line_end_offsets, edit.line);
+            if (line_view != edit.original) {
+                std::cerr << "*** ref: line has changed since the search: " << filename.string() << ":" << 
+                    edit.line << std::endl;
+                errors++;
+                continue;
+            }
+            Size line_start = line_view.data() - source.data();
+            output += source.substr(source_index, line_start - source_index);
+            output += edit.replacement;
+            source_index = line_start + line_view.length();
+            edit_count++;
+        }
+        output += source.substr(source_index);
+        outputs.emplace_back(filename, std::move(output));
+    }
+
+    if (errors > 0) {
+        std::cerr << "*** ref: no files changed" << std::endl;
+        return -1;
+    }
+
+    for (const auto &[filename, output] : outputs) {
+        UU::write_file(filename, output);
+    }
+    std::cout << "changed " << edit_count << " lines in " << outputs.size() << " files" << std::endl;
+    return 0;
+}
+
 static struct option long_options[] =
 {
+    {"apply",   required_argument, 0, 'a'},
     {"file",    required_argument, 0, 'f'},
     {"help",    no_argument,       0, 'h'},
     {"open",    required_argument, 0, 'o'},
@@ -74,14 +215,18 @@ int main(int argc, char *argv[])
 {
     String opener = getenv("EDIT_OPENER");
     std::filesystem::path refs_path = getenv("REFS_PATH");
+    std::filesystem::path edits_path;
 
     while (1) {
         int option_index = 0;
-        int c = getopt_long(argc, argv, "f:ho:v", long_options, &option_index);
+        int c = getopt_long(argc, argv, "a:f:ho:v", long_options, &option_index);
         if (c == -1)
             break;
     
         switch (c) {
+            case 'a':
+                edits_path = std::filesystem::path(optarg);
+                break;
             case 'f':
                 refs_path = std::filesystem::path(optarg);
                 break;           
@@ -105,6 +250,10 @@ int main(int argc, char *argv[])
         refs_path = std::filesystem::absolute("~/.refs");    
     }
 
+    if (!edits_path.empty()) {
+        return apply_edits(refs_path, edits_path);
+    }
+
     if (optind >= argc) {
         if (!std::filesystem::exists(refs_path)) {
             std::cerr << "*** ref: unable to open refs file: " << refs_path << std::endl;
@@ -140,6 +289,7 @@ int main(int argc, char *argv[])
     }
 
     std::vector<String> exec_args;
+    std::vector<std::filesystem::path> opened_files;
 
     if (opener == "code") {
         exec_args.push_back("-g");
@@ -156,6 +306,7 @@ int main(int argc, char *argv[])
         std::cout << ref << std::endl;
         UU::String exec_arg = ref.to_string(TextRef::Filename | TextRef::Line |  TextRef::Column);
         exec_args.push_back(exec_arg);
+        opened_files.push_back(ref.filename());
     }
 
     if (exec_args.size() == 0) {
@@ -163,6 +314,8 @@ int main(int argc, char *argv[])
         return -1;
     }
 
+    OpenHistory::record(opened_files);
+
     int rc = UU::launch(opener, exec_args);
     std::cerr << "*** ref: exec error: " << strerror(errno) << std::endl;
     return rc;
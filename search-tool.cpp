@@ -23,17 +23,28 @@
 // SOFTWARE.
 
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <deque>
 #include <fstream>
 #include <functional>
 #include <iostream>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <queue>
 #include <regex>
 #include <set>
 #include <string>
 #include <vector>
 
 #include <getopt.h>
+#include <signal.h>
 #include <stdio.h>
+#include <string.h>
+#include <unistd.h>
 
 #include <UU/UU.h>
 
@@ -61,14 +72,58 @@ using UU::Spread;
 using UU::Size;
 using UU::String;
 using UU::StringView;
+using UU::Int64;
 using UU::TextRef;
+using UU::UInt32;
+using UU::UInt64;
 
 std::mutex g_lock;
-std::vector<TextRef> g_text_refs;
+
+struct ContextLine
+{
+    Size line;
+    String text;
+};
+
+// The lines to print around one ref. A ref starts a group when its context
+// doesn't run into the context of the ref before it.
+struct RefContext
+{
+    bool starts_group = false;
+    std::vector<ContextLine> before;
+    std::vector<ContextLine> after;
+};
+
+// Where a byte search found one of its needles
+struct ByteOffset
+{
+    Size offset;
+    Size needle_index;
+};
+
+// The results for one file. Files are numbered in the order the walk finds them,
+// and results are output in that order, regardless of which searches finish first.
+struct FileResults
+{
+    fs::path filename;
+    std::vector<TextRef> refs;
+    std::vector<RefContext> contexts;
+    std::vector<bool> unaligned_refs;
+    std::vector<ByteOffset> offsets;
+    String diff;
+    Size count = 0;
+    bool passed_filter = false;
+    bool is_complete = false;
+};
+std::deque<FileResults> g_file_results;
 
 enum class Skip { SkipNone, SkipSkippables };
 enum class Mode { Search, SearchAndReplace, SearchAndReplaceDryRun };
-enum class MatchType { All, Any };
+enum class Report { Lines, Offsets, Count, FilesWithMatches, FilesWithoutMatch, Diff };
+enum class NeedleFormat { Text, Hex };
+enum class Multiline { No, Yes };
+enum class PreserveCase { No, Yes };
+enum class MatchType { All, Any, Within, FileScope };
 enum class SearchCase { Sensitive, Insensitive };
 enum class HighlightColor {
     None = 0,
@@ -84,144 +139,4891 @@ enum class HighlightColor {
 };
 enum class MergeSpreads { No, Yes };
 enum class LimitToSearchables { No, Yes };
+enum class ShowStats { No, Yes };
+enum class LimitOrder { FileOrder, Fastest };
+enum class SkipMinified { No, Yes };
+enum class ColumnUnit { Bytes, Codepoints, UTF16 };
+enum class Encoding { UTF8, UTF16LE, UTF16BE };
+enum class Kernel { Memchr, BoyerMoore, MultiLiteral, Regex, PrefilteredRegex, MultilineRegex };
 
-class Env
+static constexpr Size KernelCount = 6;
+
+static const char *kernel_name(Kernel kernel)
+{
+    switch (kernel) {
+        case Kernel::Memchr:
+            return "memchr";
+        case Kernel::BoyerMoore:
+            return "boyer-moore";
+        case Kernel::MultiLiteral:
+            return "multi-literal";
+        case Kernel::Regex:
+            return "regex";
+        case Kernel::PrefilteredRegex:
+            return "prefiltered-regex";
+        case Kernel::MultilineRegex:
+            return "multiline-regex";
+    }
+    return "unknown";
+}
+
+// Rough ranking of how common a byte is in source code and text. Lower is more common.
+// Used to pick the byte of a literal needle that memchr is least likely to stop on.
+static Size byte_commonness_rank(unsigned char c)
+{
+    // NUL is half of every UTF-16 needle for ASCII text, and of the text it's searched in
+    if (c == 0) {
+        return 0;
+    }
+    static const char common_bytes[] = " etaoinsrlcdu\n\t_()p;m=.,hfgb\"/";
+    const Size common_byte_count = sizeof(common_bytes) - 1;
+    for (Size idx = 0; idx < common_byte_count; idx++) {
+        if ((unsigned char)common_bytes[idx] == c) {
+            return idx;
+        }
+    }
+    return common_byte_count;
+}
+
+// Simple Unicode case folding for the cased scripts most likely to turn up in source
+// and localisation files: Latin, Greek, Cyrillic, Armenian and fullwidth Latin. Only
+// mappings that keep the UTF-8 length the same are included, so offsets into folded
+// text are still offsets into the original.
+static UInt32 fold_codepoint(UInt32 c)
+{
+    if (c < 0x80) {
+        return c >= 'A' && c <= 'Z' ? c + 32 : c;
+    }
+    if (c < 0x100) {
+        if (c >= 0xC0 && c <= 0xDE && c != 0xD7) {
+            return c + 32;
+        }
+        return c == 0xB5 ? 0x3BC : c;
+    }
+    if (c < 0x180) {
+        // dotted I, dotless i, kra, n preceded by apostrophe, and long s have no same-length folding
+        if (c == 0x130 || c == 0x131 || c == 0x138 || c == 0x149 || c == 0x17F) {
+            return c;
+        }
+        if (c == 0x178) {
+            return 0xFF;
+        }
+        if ((c >= 0x139 && c <= 0x148) || c >= 0x179) {
+            return (c & 1) ? c + 1 : c;
+        }
+        return (c & 1) ? c : c + 1;
+    }
+    if (c >= 0x386 && c < 0x400) {
+        if (c == 0x386) {
+            return 0x3AC;
+        }
+        if (c >= 0x388 && c <= 0x38A) {
+            return c + 37;
+        }
+        if (c == 0x38C) {
+            return 0x3CC;
+        }
+        if (c == 0x38E || c == 0x38F) {
+            return c + 63;
+        }
+        if ((c >= 0x391 && c <= 0x3A1) || (c >= 0x3A3 && c <= 0x3AB)) {
+            return c + 32;
+        }
+        return c == 0x3C2 ? 0x3C3 : c;
+    }
+    if (c >= 0x400 && c < 0x530) {
+        if (c < 0x410) {
+            return c + 80;
+        }
+        if (c < 0x430) {
+            return c + 32;
+        }
+        if (c <= 0x481 && c >= 0x460) {
+            return (c & 1) ? c : c + 1;
+        }
+        if ((c >= 0x48A && c <= 0x4BF) || c >= 0x4D0) {
+            return (c & 1) ? c : c + 1;
+        }
+        if (c == 0x4C0) {
+            return 0x4CF;
+        }
+        if (c >= 0x4C1 && c <= 0x4CE) {
+            return (c & 1) ? c + 1 : c;
+        }
+        return c;
+    }
+    if (c >= 0x531 && c <= 0x556) {
+        return c + 48;
+    }
+    if ((c >= 0x1E00 && c <= 0x1E95) || (c >= 0x1EA0 && c <= 0x1EFF)) {
+        return (c & 1) ? c : c + 1;
+    }
+    if (c >= 0xFF21 && c <= 0xFF3A) {
+        return c + 32;
+    }
+    return c;
+}
+
+// Lowercases the ASCII letters in a word of eight bytes all at once. Adding to the low seven
+// bits of each byte sets its high bit when the byte is past 'Z', or at least 'A'. Bytes with
+// only the second of those set, and no high bit of their own, get 0x20 added.
+static UInt64 fold_ascii_word(UInt64 word)
+{
+    const UInt64 high_bits = 0x8080808080808080ULL;
+    const UInt64 ones = 0x0101010101010101ULL;
+    UInt64 low_bits = word & ~high_bits;
+    UInt64 is_past_upper = low_bits + ones * (0x7F - 'Z');
+    UInt64 is_at_least_upper = low_bits + ones * (0x80 - 'A');
+    UInt64 is_upper = is_at_least_upper & ~is_past_upper & ~word & high_bits;
+    return word | (is_upper >> 2);
+}
+
+// Returns a case-folded copy of the given UTF-8 text with the same length. Each eight-byte
+// block that's pure ASCII is folded in one step. Other bytes are decoded and folded with
+// fold_codepoint, unless unicode is false, in which case only ASCII letters are folded.
+static String fold_case(StringView text, bool unicode)
+{
+    String folded = String(text);
+    char *data = &folded[0];
+    const Size length = text.length();
+    const UInt64 high_bits = 0x8080808080808080ULL;
+
+    Size idx = 0;
+    while (idx < length) {
+        if (idx + sizeof(UInt64) <= length) {
+            UInt64 word;
+            memcpy(&word, data + idx, sizeof(UInt64));
+            if ((word & high_bits) == 0 || !unicode) {
+                word = fold_ascii_word(word);
+                memcpy(data + idx, &word, sizeof(UInt64));
+                idx += sizeof(UInt64);
+                continue;
+            }
+        }
+
+        unsigned char c = data[idx];
+        if (c < 0x80) {
+            data[idx] = c >= 'A' && c <= 'Z' ? c + 32 : c;
+            idx++;
+            continue;
+        }
+        if (!unicode) {
+            idx++;
+            continue;
+        }
+
+        // fold two- and three-byte sequences, the only lengths with foldings
+        Size sequence_length = c >= 0xC2 && c <= 0xDF ? 2 : (c >= 0xE0 && c <= 0xEF ? 3 : 1);
+        if (idx + sequence_length > length) {
+            sequence_length = 1;
+        }
+        for (Size byte = 1; byte < sequence_length; byte++) {
+            if ((data[idx + byte] & 0xC0) != 0x80) {
+                sequence_length = 1;
+                break;
+            }
+        }
+        if (sequence_length == 2) {
+            UInt32 codepoint = ((c & 0x1F) << 6) | (data[idx + 1] & 0x3F);
+            UInt32 folded_codepoint = fold_codepoint(codepoint);
+            if (folded_codepoint != codepoint && folded_codepoint >= 0x80 && folded_codepoint < 0x800) {
+                data[idx] = 0xC0 | (folded_codepoint >> 6);
+                data[idx + 1] = 0x80 | (folded_codepoint & 0x3F);
+            }
+        }
+        else if (sequence_length == 3) {
+            UInt32 codepoint = ((c & 0x0F) << 12) | ((data[idx + 1] & 0x3F) << 6) | (data[idx + 2] & 0x3F);
+            UInt32 folded_codepoint = fold_codepoint(codepoint);
+            if (folded_codepoint != codepoint && folded_codepoint >= 0x800 && folded_codepoint < 0x10000) {
+                data[idx] = 0xE0 | (folded_codepoint >> 12);
+                data[idx + 1] = 0x80 | ((folded_codepoint >> 6) & 0x3F);
+                data[idx + 2] = 0x80 | (folded_codepoint & 0x3F);
+            }
+        }
+        idx += sequence_length;
+    }
+    return folded;
+}
+
+// Reads the UTF-8 sequence at idx, moving idx past it. Malformed sequences read as U+FFFD.
+static UInt32 next_utf8_codepoint(StringView text, Size &idx)
+{
+    unsigned char c = text[idx++];
+    if (c < 0x80) {
+        return c;
+    }
+    Size continuation_count = 0;
+    UInt32 codepoint = 0xFFFD;
+    if (c >= 0xC2 && c <= 0xDF) {
+        continuation_count = 1;
+        codepoint = c & 0x1F;
+    }
+    else if (c >= 0xE0 && c <= 0xEF) {
+        continuation_count = 2;
+        codepoint = c & 0x0F;
+    }
+    else if (c >= 0xF0 && c <= 0xF4) {
+        continuation_count = 3;
+        codepoint = c & 0x07;
+    }
+    if (idx + continuation_count > text.length()) {
+        return 0xFFFD;
+    }
+    for (Size count = 0; count < continuation_count; count++) {
+        unsigned char d = text[idx];
+        if ((d & 0xC0) != 0x80) {
+            return 0xFFFD;
+        }
+        codepoint = (codepoint << 6) | (d & 0x3F);
+        idx++;
+    }
+    return codepoint;
+}
+
+static void append_utf8(String &text, UInt32 codepoint)
+{
+    if (codepoint < 0x80) {
+        text += (char)codepoint;
+    }
+    else if (codepoint < 0x800) {
+        text += (char)(0xC0 | (codepoint >> 6));
+        text += (char)(0x80 | (codepoint & 0x3F));
+    }
+    else if (codepoint < 0x10000) {
+        text += (char)(0xE0 | (codepoint >> 12));
+        text += (char)(0x80 | ((codepoint >> 6) & 0x3F));
+        text += (char)(0x80 | (codepoint & 0x3F));
+    }
+    else {
+        text += (char)(0xF0 | (codepoint >> 18));
+        text += (char)(0x80 | ((codepoint >> 12) & 0x3F));
+        text += (char)(0x80 | ((codepoint >> 6) & 0x3F));
+        text += (char)(0x80 | (codepoint & 0x3F));
+    }
+}
+
+static UInt32 utf16_unit_at(StringView text, Size idx, Encoding encoding)
+{
+    unsigned char first = text[idx];
+    unsigned char second = text[idx + 1];
+    return encoding == Encoding::UTF16LE ? first | (second << 8) : (first << 8) | second;
+}
+
+static void store_utf16_unit(char *data, UInt32 unit, Encoding encoding)
+{
+    char low = unit & 0xFF;
+    char high = (unit >> 8) & 0xFF;
+    data[0] = encoding == Encoding::UTF16LE ? low : high;
+    data[1] = encoding == Encoding::UTF16LE ? high : low;
+}
+
+// Reads the UTF-16 character at idx, moving idx past it. Unpaired surrogates read as U+FFFD.
+static UInt32 next_utf16_codepoint(StringView text, Size &idx, Encoding encoding)
+{
+    UInt32 unit = utf16_unit_at(text, idx, encoding);
+    idx += 2;
+    if (unit < 0xD800 || unit > 0xDFFF) {
+        return unit;
+    }
+    if (unit <= 0xDBFF && idx + 2 <= text.length()) {
+        UInt32 low_unit = utf16_unit_at(text, idx, encoding);
+        if (low_unit >= 0xDC00 && low_unit <= 0xDFFF) {
+            idx += 2;
+            return 0x10000 + ((unit - 0xD800) << 10) + (low_unit - 0xDC00);
+        }
+    }
+    return 0xFFFD;
+}
+
+// Transcodes UTF-8 text to UTF-16 in the given byte order
+static String encode_utf16(StringView text, Encoding encoding)
+{
+    String result;
+    result.reserve(text.length() * 2);
+    char unit[2];
+    auto append_unit = [&](UInt32 value) {
+        store_utf16_unit(unit, value, encoding);
+        result += unit[0];
+        result += unit[1];
+    };
+    Size idx = 0;
+    while (idx < text.length()) {
+        UInt32 codepoint = next_utf8_codepoint(text, idx);
+        if (codepoint >= 0x10000) {
+            codepoint -= 0x10000;
+            append_unit(0xD800 | (codepoint >> 10));
+            append_unit(0xDC00 | (codepoint & 0x3FF));
+        }
+        else {
+            append_unit(codepoint);
+        }
+    }
+    return result;
+}
+
+// Transcodes UTF-16 text in the given byte order to UTF-8. An odd byte at the end is dropped.
+static String decode_utf16(StringView text, Encoding encoding)
+{
+    String result;
+    result.reserve(text.length());
+    Size idx = 0;
+    while (idx + 2 <= text.length()) {
+        append_utf8(result, next_utf16_codepoint(text, idx, encoding));
+    }
+    return result;
+}
+
+// Returns the length decode_utf16 would give the same text, without decoding it
+static Size decoded_utf16_length(StringView text, Encoding encoding)
+{
+    Size length = 0;
+    Size idx = 0;
+    while (idx + 2 <= text.length()) {
+        UInt32 codepoint = next_utf16_codepoint(text, idx, encoding);
+        length += codepoint < 0x80 ? 1 : (codepoint < 0x800 ? 2 : (codepoint < 0x10000 ? 3 : 4));
+    }
+    return length;
+}
+
+// Returns a case-folded copy of UTF-16 text. Every folding fold_codepoint makes stays
+// inside the BMP, so each unit folds on its own and offsets stay the same.
+static String fold_case_utf16(StringView text, Encoding encoding, bool unicode)
+{
+    String folded = String(text);
+    char *data = &folded[0];
+    for (Size idx = 0; idx + 2 <= text.length(); idx += 2) {
+        UInt32 unit = utf16_unit_at(text, idx, encoding);
+        if (unit >= 0x80 && !unicode) {
+            continue;
+        }
+        UInt32 folded_unit = fold_codepoint(unit);
+        if (folded_unit != unit) {
+            store_utf16_unit(data + idx, folded_unit, encoding);
+        }
+    }
+    return folded;
+}
+
+class LiteralNeedle
 {
 public:
-    Env(const fs::path &current_path,
-        const std::vector<String> &string_needles,
-        const std::vector<std::regex> &regex_needles,
-        const String &replacement,
-        TextRef::FilenameFormat filename_format,
-        HighlightColor highlight_color,
-        MatchType match_type,
-        MergeSpreads merge_spreads,
-        Mode mode,
-        SearchCase search_case,
-        Skip skip,
-        LimitToSearchables limit_to_searchables) :
-        m_current_path(current_path),
-        m_string_needles(string_needles),
-        m_regex_needles(regex_needles),
-        m_replacement(replacement),
-        m_filename_format(filename_format),
-        m_highlight_color(highlight_color),
-        m_match_type(match_type),
-        m_merge_spreads(merge_spreads),
-        m_mode(mode),
-        m_search_case(search_case),
-        m_skip(skip),
-        m_limit_to_searchables(limit_to_searchables)
-    {}
+    LiteralNeedle() {}
+    LiteralNeedle(Size index, const String &text) : m_index(index), m_text(text) {
+        Size rarest_rank = 0;
+        for (Size idx = 0; idx < m_text.length(); idx++) {
+            Size rank = byte_commonness_rank(m_text[idx]);
+            if (idx == 0 || rank > rarest_rank) {
+                rarest_rank = rank;
+                m_rare_byte_offset = idx;
+            }
+        }
+    }
 
-    const fs::path &current_path() const { return m_current_path; }
-    const std::vector<String> &string_needles() const { return m_string_needles; }
-    const std::vector<std::regex> &regex_needles() const { return m_regex_needles; }
-    const String &replacement() const { return m_replacement; }
-    TextRef::FilenameFormat filename_format() const { return m_filename_format; }
-    HighlightColor highlight_color() const { return m_highlight_color; }
-    MatchType match_type() const { return m_match_type; }
-    MergeSpreads merge_spreads() const { return m_merge_spreads; }
-    Mode mode() const { return m_mode; }
-    SearchCase search_case() const { return m_search_case; }
-    Skip skip() const { return m_skip; }
-    LimitToSearchables limit_to_searchables() const { return m_limit_to_searchables; }
+    Size index() const { return m_index; }
+    const String &text() const { return m_text; }
+    Size length() const { return m_text.length(); }
+    bool is_empty() const { return m_text.length() == 0; }
+    Size rare_byte_offset() const { return m_rare_byte_offset; }
+
+private:
+    Size m_index = 0;
+    String m_text;
+    Size m_rare_byte_offset = 0;
+};
+
+// Returns the longest run of literal characters that every match of the given
+// egrep-style pattern must contain, or an empty string if there isn't one.
+static String required_literal_for_regex(const String &pattern)
+{
+    const Size length = pattern.length();
+
+    // skip past a bracket expression starting at idx, returning the index of its closing bracket
+    auto skip_bracket = [&](Size idx) {
+        idx++;
+        if (idx < length && pattern[idx] == '^') {
+            idx++;
+        }
+        if (idx < length && pattern[idx] == ']') {
+            idx++;
+        }
+        while (idx < length && pattern[idx] != ']') {
+            idx++;
+        }
+        return idx;
+    };
+
+    // top-level alternation means no single literal is required
+    int depth = 0;
+    for (Size idx = 0; idx < length; idx++) {
+        char c = pattern[idx];
+        if (c == '\\') {
+            idx++;
+        }
+        else if (c == '[') {
+            idx = skip_bracket(idx);
+        }
+        else if (c == '(') {
+            depth++;
+        }
+        else if (c == ')') {
+            depth--;
+        }
+        else if (c == '|' && depth == 0) {
+            return String();
+        }
+    }
+
+    String best;
+    String run;
+    auto commit_run = [&]() {
+        if (run.length() > best.length()) {
+            best = run;
+        }
+        run.clear();
+    };
+
+    for (Size idx = 0; idx < length; idx++) {
+        char c = pattern[idx];
+        char literal = 0;
+        bool is_literal = false;
+        if (c == '\\') {
+            if (idx + 1 >= length) {
+                break;
+            }
+            idx++;
+            if (ispunct((unsigned char)pattern[idx])) {
+                literal = pattern[idx];
+                is_literal = true;
+            }
+        }
+        else if (c == '[') {
+            idx = skip_bracket(idx);
+        }
+        else if (c == '(') {
+            int group_depth = 1;
+            while (++idx < length && group_depth > 0) {
+                if (pattern[idx] == '\\') {
+                    idx++;
+                }
+                else if (pattern[idx] == '[') {
+                    idx = skip_bracket(idx);
+                }
+                else if (pattern[idx] == '(') {
+                    group_depth++;
+                }
+                else if (pattern[idx] == ')') {
+                    group_depth--;
+                }
+            }
+            idx--;
+        }
+        else if (c == '{') {
+            while (idx < length && pattern[idx] != '}') {
+                idx++;
+            }
+        }
+        else if (strchr(".^$*+?)", c) == nullptr) {
+            literal = c;
+            is_literal = true;
+        }
+
+        // a quantifier after the atom decides whether it is required
+        char next = idx + 1 < length ? pattern[idx + 1] : 0;
+        bool is_optional = next == '*' || next == '?' || next == '{';
+        if (is_literal && !is_optional) {
+            run += literal;
+            if (next == '+') {
+                commit_run();
+            }
+        }
+        else {
+            commit_run();
+        }
+    }
+    commit_run();
+
+    return best;
+}
+
+// Trigrams are three bytes packed into the low 24 bits of a UInt32, with ASCII letters
+// lowercased, so one index serves case-sensitive and case-insensitive searches alike.
+static UInt32 trigram_at(const char *data)
+{
+    auto byte = [](char c) -> UInt32 {
+        unsigned char u = c;
+        return u >= 'A' && u <= 'Z' ? u + 32 : u;
+    };
+    return (byte(data[0]) << 16) | (byte(data[1]) << 8) | byte(data[2]);
+}
+
+// A boolean query over trigrams that every file holding a match must satisfy. All means
+// any file might match, and None means no file can. An And needs every trigram and
+// sub-query it lists, and an Or needs at least one.
+class TrigramQuery
+{
+public:
+    enum class Op { All, None, And, Or };
+
+    TrigramQuery(Op op = Op::All) : m_op(op) {}
+
+    // Every trigram of the string. A non-ASCII byte can turn up in a case-insensitive match as
+    // some other byte, so trigrams with one in them are left out of those queries.
+    static TrigramQuery for_string(StringView text, SearchCase search_case) {
+        TrigramQuery query(Op::And);
+        for (Size idx = 0; idx + 3 <= text.length(); idx++) {
+            StringView trigram = text.substr(idx, 3);
+            if (search_case == SearchCase::Insensitive &&
+                std::any_of(trigram.begin(), trigram.end(), [](unsigned char c) { return c >= 0x80; })) {
+                continue;
+            }
+            query.m_trigrams.push_back(trigram_at(trigram.data()));
+        }
+        return query.simplified();
+    }
+
+    static TrigramQuery for_strings(const std::set<String> &strings, SearchCase search_case) {
+        TrigramQuery query(Op::None);
+        for (const auto &string : strings) {
+            query = query.or_with(for_string(string, search_case));
+        }
+        return query;
+    }
+
+    Op op() const { return m_op; }
+    bool is_all() const { return m_op == Op::All; }
+    const std::vector<UInt32> &trigrams() const { return m_trigrams; }
+    const std::vector<TrigramQuery> &subqueries() const { return m_subqueries; }
+
+    TrigramQuery and_with(const TrigramQuery &other) const { return combine(Op::And, other); }
+    TrigramQuery or_with(const TrigramQuery &other) const { return combine(Op::Or, other); }
+
+    String to_string() const {
+        switch (m_op) {
+            case Op::All:
+                return "+";
+            case Op::None:
+                return "-";
+            default:
+                break;
+        }
+        String result;
+        const char *separator = m_op == Op::And ? " " : " | ";
+        for (UInt32 trigram : m_trigrams) {
+            if (result.length() > 0) {
+                result += separator;
+            }
+            result += '"';
+            for (int shift = 16; shift >= 0; shift -= 8) {
+                unsigned char c = (trigram >> shift) & 0xFF;
+                if (isprint(c) && c != '"' && c != '\\') {
+                    result += c;
+                }
+                else {
+                    char hex[8];
+                    snprintf(hex, sizeof(hex), "\\x%02x", c);
+                    result += hex;
+                }
+            }
+            result += '"';
+        }
+        for (const auto &subquery : m_subqueries) {
+            if (result.length() > 0) {
+                result += separator;
+            }
+            result += "(";
+            result += subquery.to_string();
+            result += ")";
+        }
+        return result;
+    }
+
+private:
+    TrigramQuery combine(Op op, const TrigramQuery &other) const {
+        // All and None absorb or drop out, depending on the operation
+        Op absorbing = op == Op::And ? Op::None : Op::All;
+        Op identity = op == Op::And ? Op::All : Op::None;
+        if (m_op == absorbing || other.m_op == identity) {
+            return *this;
+        }
+        if (other.m_op == absorbing || m_op == identity) {
+            return other;
+        }
+
+        // operands with the same operation are merged rather than nested
+        TrigramQuery result(op);
+        for (const auto *operand : { this, &other }) {
+            if (operand->m_op == op) {
+                result.m_trigrams.insert(result.m_trigrams.end(), operand->m_trigrams.begin(), operand->m_trigrams.end());
+                result.m_subqueries.insert(result.m_subqueries.end(), operand->m_subqueries.begin(),
+                    operand->m_subqueries.end());
+            }
+            else if (operand->m_subqueries.empty() && operand->m_trigrams.size() == 1) {
+                result.m_trigrams.push_back(operand->m_trigrams.front());
+            }
+            else {
+                result.m_subqueries.push_back(*operand);
+            }
+        }
+        return result.simplified();
+    }
+
+    TrigramQuery simplified() const {
+        TrigramQuery result(*this);
+        std::sort(result.m_trigrams.begin(), result.m_trigrams.end());
+        result.m_trigrams.erase(std::unique(result.m_trigrams.begin(), result.m_trigrams.end()), result.m_trigrams.end());
+        if (result.m_trigrams.empty() && result.m_subqueries.empty()) {
+            return TrigramQuery(m_op == Op::And ? Op::All : Op::None);
+        }
+        if (result.m_trigrams.empty() && result.m_subqueries.size() == 1) {
+            return result.m_subqueries.front();
+        }
+        return result;
+    }
+
+    Op m_op;
+    std::vector<UInt32> m_trigrams;
+    std::vector<TrigramQuery> m_subqueries;
+};
+
+// Works out a trigram query for a regex, in the manner of Russ Cox's codesearch. Each part
+// of the pattern is summed up by what it could match: the exact set of strings when that
+// set is small, or else the prefixes and suffixes of its matches, along with a query that
+// any match must satisfy. Strings are kept lowercased, like trigrams. Anything the analysis
+// doesn't understand could match anything, so the query is always safe to use, if not
+// always useful.
+class RegexTrigramAnalyzer
+{
+public:
+    static constexpr Size MaxSetSize = 16;
+    static constexpr Size MaxClassSize = 8;
+
+    RegexTrigramAnalyzer(const String &pattern, Multiline multiline, SearchCase search_case) :
+        m_pattern(pattern), m_ecmascript(multiline == Multiline::Yes), m_search_case(search_case) {}
+
+    TrigramQuery query() {
+        m_pos = 0;
+        Info info = parse_alternation();
+        if (m_pos < m_pattern.length()) {
+            return TrigramQuery();
+        }
+        simplify(info, true);
+        return info.match;
+    }
+
+private:
+    struct Info
+    {
+        bool can_be_empty = false;
+        bool has_exact = false;
+        std::set<String> exact;
+        std::set<String> prefix;
+        std::set<String> suffix;
+        TrigramQuery match;
+    };
+
+    static Info empty_string() {
+        Info info;
+        info.can_be_empty = true;
+        info.has_exact = true;
+        info.exact.insert(String());
+        return info;
+    }
+
+    static Info any_char() {
+        Info info;
+        info.prefix.insert(String());
+        info.suffix.insert(String());
+        return info;
+    }
+
+    static Info any_string() {
+        Info info = any_char();
+        info.can_be_empty = true;
+        return info;
+    }
+
+    static Info chars(const std::set<unsigned char> &set) {
+        if (set.empty() || set.size() > MaxClassSize) {
+            return any_char();
+        }
+        Info info;
+        info.has_exact = true;
+        for (unsigned char c : set) {
+            info.exact.insert(String(1, c >= 'A' && c <= 'Z' ? c + 32 : c));
+        }
+        return info;
+    }
+
+    static std::set<String> cross(const std::set<String> &a, const std::set<String> &b) {
+        std::set<String> result;
+        for (const auto &x : a) {
+            for (const auto &y : b) {
+                result.insert(x + y);
+            }
+        }
+        return result;
+    }
+
+    // trims a set of prefixes or suffixes to the given length, keeping the end that
+    // touches the rest of the match
+    static std::set<String> trimmed(const std::set<String> &set, Size length, bool keep_end) {
+        std::set<String> result;
+        for (const auto &s : set) {
+            if (s.length() <= length) {
+                result.insert(s);
+            }
+            else {
+                result.insert(keep_end ? s.substr(s.length() - length) : s.substr(0, length));
+            }
+        }
+        return result;
+    }
+
+    // Once an exact set grows too large, or when forced at the end, it's folded into the
+    // match query and replaced by prefixes and suffixes. Prefixes and suffixes long enough
+    // to have trigrams are folded in the same way, and then cut back to the two bytes that
+    // can still make trigrams with what comes before or after.
+    void simplify(Info &info, bool force) const {
+        if (info.has_exact && (force || info.exact.size() > MaxSetSize)) {
+            info.match = info.match.and_with(TrigramQuery::for_strings(info.exact, m_search_case));
+            info.prefix = trimmed(info.exact, 2, false);
+            info.suffix = trimmed(info.exact, 2, true);
+            info.has_exact = false;
+            info.exact.clear();
+        }
+        if (!info.has_exact) {
+            auto has_trigrams = [](const std::set<String> &set) {
+                return std::any_of(set.begin(), set.end(), [](const String &s) { return s.length() >= 3; });
+            };
+            if (has_trigrams(info.prefix)) {
+                info.match = info.match.and_with(TrigramQuery::for_strings(info.prefix, m_search_case));
+                info.prefix = trimmed(info.prefix, 2, false);
+            }
+            if (has_trigrams(info.suffix)) {
+                info.match = info.match.and_with(TrigramQuery::for_strings(info.suffix, m_search_case));
+                info.suffix = trimmed(info.suffix, 2, true);
+            }
+            for (Size length = 2; info.prefix.size() > MaxSetSize; length--) {
+                info.prefix = trimmed(info.prefix, length, false);
+            }
+            for (Size length = 2; info.suffix.size() > MaxSetSize; length--) {
+                info.suffix = trimmed(info.suffix, length, true);
+            }
+        }
+    }
+
+    Info concat(const Info &x, const Info &y) const {
+        Info xy;
+        xy.can_be_empty = x.can_be_empty && y.can_be_empty;
+        xy.match = x.match.and_with(y.match);
+        if (x.has_exact && y.has_exact) {
+            xy.has_exact = true;
+            xy.exact = cross(x.exact, y.exact);
+        }
+        else {
+            const std::set<String> &x_suffix = x.has_exact ? x.exact : x.suffix;
+            const std::set<String> &y_prefix = y.has_exact ? y.exact : y.prefix;
+            xy.prefix = x.has_exact ? cross(x.exact, y_prefix) : x.prefix;
+            if (!x.has_exact && x.can_be_empty) {
+                xy.prefix.insert(y_prefix.begin(), y_prefix.end());
+            }
+            xy.suffix = y.has_exact ? cross(x_suffix, y.exact) : y.suffix;
+            if (!y.has_exact && y.can_be_empty) {
+                xy.suffix.insert(x_suffix.begin(), x_suffix.end());
+            }
+            // trigrams that span the boundary between the two parts
+            if (!x.has_exact && !y.has_exact && x.suffix.size() * y.prefix.size() <= MaxSetSize) {
+                xy.match = xy.match.and_with(TrigramQuery::for_strings(cross(x.suffix, y.prefix), m_search_case));
+            }
+            // an exact side is remembered in the match before its strings become a prefix or suffix
+            if (x.has_exact) {
+                xy.match = xy.match.and_with(TrigramQuery::for_strings(x.exact, m_search_case));
+            }
+            if (y.has_exact) {
+                xy.match = xy.match.and_with(TrigramQuery::for_strings(y.exact, m_search_case));
+            }
+        }
+        simplify(xy, false);
+        return xy;
+    }
+
+    Info alternate(Info x, Info y) const {
+        Info xy;
+        xy.can_be_empty = x.can_be_empty || y.can_be_empty;
+        if (x.has_exact && y.has_exact) {
+            xy.has_exact = true;
+            xy.exact = x.exact;
+            xy.exact.insert(y.exact.begin(), y.exact.end());
+            xy.match = x.match.or_with(y.match);
+        }
+        else {
+            simplify(x, true);
+            simplify(y, true);
+            xy.prefix = x.prefix;
+            xy.prefix.insert(y.prefix.begin(), y.prefix.end());
+            xy.suffix = x.suffix;
+            xy.suffix.insert(y.suffix.begin(), y.suffix.end());
+            xy.match = x.match.or_with(y.match);
+        }
+        simplify(xy, false);
+        return xy;
+    }
+
+    Info optional(const Info &x) const {
+        return alternate(x, empty_string());
+    }
+
+    // x+ is x followed by x*, and x* could be anything
+    Info repeated(const Info &x) const {
+        return concat(x, any_string());
+    }
+
+    bool at_end() const { return m_pos >= m_pattern.length(); }
+    char peek() const { return m_pattern[m_pos]; }
+
+    // a literal newline separates alternatives in egrep patterns, like |
+    bool at_alternation() const { return !at_end() && (peek() == '|' || (!m_ecmascript && peek() == '\n')); }
+
+    Info parse_alternation() {
+        Info info = parse_concatenation();
+        while (at_alternation()) {
+            m_pos++;
+            info = alternate(info, parse_concatenation());
+        }
+        return info;
+    }
+
+    Info parse_concatenation() {
+        Info info = empty_string();
+        while (!at_end() && !at_alternation() && peek() != ')') {
+            info = concat(info, parse_repetition());
+        }
+        return info;
+    }
+
+    Info parse_repetition() {
+        Info info = parse_atom();
+        while (!at_end()) {
+            char c = peek();
+            if (c == '*') {
+                info = any_string();
+            }
+            else if (c == '+') {
+                info = repeated(info);
+            }
+            else if (c == '?') {
+                info = optional(info);
+            }
+            else if (c == '{') {
+                Size close = m_pattern.find('}', m_pos);
+                if (close == String::npos) {
+                    break;
+                }
+                Size min = strtoul(m_pattern.c_str() + m_pos + 1, nullptr, 10);
+                info = min == 0 ? any_string() : repeated(info);
+                m_pos = close;
+            }
+            else {
+                break;
+            }
+            m_pos++;
+            // lazy quantifiers match the same strings
+            if (m_ecmascript && !at_end() && peek() == '?') {
+                m_pos++;
+            }
+        }
+        return info;
+    }
+
+    Info parse_atom() {
+        char c = m_pattern[m_pos++];
+        switch (c) {
+            case '(': {
+                bool is_lookaround = false;
+                if (m_ecmascript && m_pos + 1 < m_pattern.length() && peek() == '?') {
+                    is_lookaround = m_pattern[m_pos + 1] != ':';
+                    m_pos += 2;
+                }
+                Info info = parse_alternation();
+                if (!at_end() && peek() == ')') {
+                    m_pos++;
+                }
+                return is_lookaround ? empty_string() : info;
+            }
+            case '[':
+                return parse_bracket();
+            case '.':
+                return any_char();
+            case '^':
+            case '$':
+                return empty_string();
+            case '\\':
+                return parse_escape();
+            default:
+                return chars({ (unsigned char)c });
+        }
+    }
+
+    Info parse_escape() {
+        if (at_end()) {
+            return any_string();
+        }
+        char c = m_pattern[m_pos++];
+        if (c >= '1' && c <= '9') {
+            return any_string();
+        }
+        if (ispunct((unsigned char)c)) {
+            return chars({ (unsigned char)c });
+        }
+        if (m_ecmascript) {
+            switch (c) {
+                case 'b':
+                case 'B':
+                    return empty_string();
+                case 'n':
+                    return chars({ '\n' });
+                case 't':
+                    return chars({ '\t' });
+                case 'r':
+                    return chars({ '\r' });
+                case 'f':
+                    return chars({ '\f' });
+                case 'v':
+                    return chars({ '\v' });
+                case 'x':
+                    m_pos = std::min(m_pos + 2, m_pattern.length());
+                    return any_char();
+                case 'u':
+                    m_pos = std::min(m_pos + 4, m_pattern.length());
+                    return any_char();
+                case 'c':
+                    m_pos = std::min(m_pos + 1, m_pattern.length());
+                    return any_char();
+                default:
+                    break;
+            }
+        }
+        return any_char();
+    }
+
+    Info parse_bracket() {
+        std::set<unsigned char> set;
+        bool negated = !at_end() && peek() == '^';
+        bool understood = !negated;
+        if (negated) {
+            m_pos++;
+        }
+        // in ECMAScript, [] matches nothing and [^] matches anything
+        if (m_ecmascript && !at_end() && peek() == ']') {
+            m_pos++;
+            return any_char();
+        }
+        bool first = true;
+        while (!at_end() && (peek() != ']' || first)) {
+            unsigned char c = m_pattern[m_pos++];
+            first = false;
+            if (c == '[' && !at_end() && (peek() == ':' || peek() == '.' || peek() == '=')) {
+                // a character class name like [:alpha:]
+                char kind = peek();
+                Size close = m_pattern.find(String(1, kind) + "]", m_pos + 1);
+                m_pos = close == String::npos ? m_pattern.length() : close + 2;
+                understood = false;
+                continue;
+            }
+            if (c == '\\' && m_ecmascript && !at_end()) {
+                c = m_pattern[m_pos++];
+                if (!ispunct(c)) {
+                    understood = false;
+                    continue;
+                }
+            }
+            if (m_pos + 1 < m_pattern.length() && peek() == '-' && m_pattern[m_pos + 1] != ']') {
+                unsigned char last = m_pattern[m_pos + 1];
+                m_pos += 2;
+                if (last < c || Size(last - c) >= MaxClassSize) {
+                    understood = false;
+                    continue;
+                }
+                for (unsigned int r = c; r <= last; r++) {
+                    set.insert(r);
+                }
+                continue;
+            }
+            set.insert(c);
+        }
+        if (!at_end()) {
+            m_pos++;
+        }
+        return understood ? chars(set) : any_char();
+    }
+
+    const String &m_pattern;
+    bool m_ecmascript;
+    SearchCase m_search_case;
+    Size m_pos = 0;
+};
+
+class QueryPlan
+{
+public:
+    static constexpr Size SmallFileLength = 16 * 1024;
+    static constexpr Size BoyerMooreMinimumNeedleLength = 8;
+    static constexpr Size PrefilterMinimumLength = 2;
+
+    QueryPlan() {}
+    // Exclusion needles are searched for along with the literal needles, and numbered after all the
+    // other needles. Lines that contain one are left out of the results.
+    QueryPlan(const std::vector<String> &string_needles, const std::vector<String> &regex_patterns, 
+        const std::vector<String> &exclusion_needles, SearchCase search_case, Multiline multiline = Multiline::No, 
+        Encoding encoding = Encoding::UTF8) : 
+        m_string_needle_count(string_needles.size()), 
+        m_needle_count(string_needles.size() + regex_patterns.size()), 
+        m_multiline(multiline == Multiline::Yes) {
+        auto add_literal = [&](Size needle_index, const String &text) {
+            m_literals.emplace_back(needle_index, encoding == Encoding::UTF8 ? text : encode_utf16(text, encoding));
+        };
+        Size needle_index = 0;
+        for (const auto &string_needle : string_needles) {
+            add_literal(needle_index, string_needle);
+            needle_index++;
+        }
+        for (Size idx = 0; idx < exclusion_needles.size(); idx++) {
+            add_literal(m_needle_count + idx, exclusion_needles[idx]);
+        }
+
+        // case folding the haystack is only needed when a literal needle contains a letter,
+        // and non-ASCII text only needs folding when a needle has non-ASCII characters,
+        // since none of them fold to ASCII
+        if (search_case == SearchCase::Insensitive) {
+            std::vector<String> folded_needles = string_needles;
+            folded_needles.insert(folded_needles.end(), exclusion_needles.begin(), exclusion_needles.end());
+            for (const auto &folded_needle : folded_needles) {
+                for (unsigned char c : folded_needle) {
+                    if (c >= 0x80) {
+                        m_folds_haystack = true;
+                        m_folds_unicode = true;
+                    }
+                    else if (isalpha(c)) {
+                        m_folds_haystack = true;
+                    }
+                }
+            }
+        }
+
+        // bucket literal needles by first byte for the multi-literal kernel
+        m_first_bytes.fill(false);
+        for (Size idx = 0; idx < m_literals.size(); idx++) {
+            const auto &literal = m_literals[idx];
+            if (literal.is_empty()) {
+                continue;
+            }
+            unsigned char c = literal.text()[0];
+            if (!m_first_bytes[c]) {
+                m_first_bytes[c] = true;
+                m_distinct_first_byte_count++;
+                m_single_first_byte = c;
+            }
+            m_first_byte_buckets[c].push_back(idx);
+        }
+
+        // regexes run against the unfolded haystack, so an icase regex can
+        // only be prefiltered by a literal that has no letters in it
+        for (const auto &regex_pattern : regex_patterns) {
+            String prefilter = required_literal_for_regex(regex_pattern);
+            if (search_case == SearchCase::Insensitive &&
+                std::any_of(prefilter.begin(), prefilter.end(), [](unsigned char c) { return isalpha(c); })) {
+                prefilter.clear();
+            }
+            if (prefilter.length() < PrefilterMinimumLength) {
+                prefilter.clear();
+            }
+            m_regex_prefilters.emplace_back(needle_index, prefilter);
+            needle_index++;
+        }
+
+        // each needle's query for narrowing the files to search with an index
+        if (encoding == Encoding::UTF8) {
+            for (const auto &string_needle : string_needles) {
+                m_trigram_queries.push_back(TrigramQuery::for_string(string_needle, search_case));
+            }
+            for (const auto &regex_pattern : regex_patterns) {
+                m_trigram_queries.push_back(RegexTrigramAnalyzer(regex_pattern, multiline, search_case).query());
+            }
+        }
+
+        // UTF-16 files are searched for the literal needles transcoded to match
+        if (encoding == Encoding::UTF8 && m_literals.size() > 0) {
+            m_utf16le_plan = std::make_shared<QueryPlan>(string_needles, std::vector<String>(), exclusion_needles, search_case, 
+                Multiline::No, Encoding::UTF16LE);
+            m_utf16be_plan = std::make_shared<QueryPlan>(string_needles, std::vector<String>(), exclusion_needles, search_case, 
+                Multiline::No, Encoding::UTF16BE);
+        }
+    }
+
+    // Returns the plan for searching text in the given encoding. Only literal needles
+    // have UTF-16 plans, so only call this for UTF-16 when there are no regex needles.
+    const QueryPlan &for_encoding(Encoding encoding) const {
+        switch (encoding) {
+            case Encoding::UTF16LE:
+                return *m_utf16le_plan;
+            case Encoding::UTF16BE:
+                return *m_utf16be_plan;
+            default:
+                return *this;
+        }
+    }
+
+    const std::vector<LiteralNeedle> &literals() const { return m_literals; }
+    Size string_needle_count() const { return m_string_needle_count; }
+    bool has_exclusions() const { return m_literals.size() > m_string_needle_count; }
+    bool is_exclusion(Size needle_index) const { return needle_index >= m_needle_count; }
+    const std::vector<LiteralNeedle> &regex_prefilters() const { return m_regex_prefilters; }
+    const std::vector<TrigramQuery> &trigram_queries() const { return m_trigram_queries; }
+    bool folds_haystack() const { return m_folds_haystack; }
+    bool folds_unicode() const { return m_folds_unicode; }
+    bool is_multiline() const { return m_multiline; }
+
+    bool is_first_byte(unsigned char c) const { return m_first_bytes[c]; }
+    const std::vector<Size> &first_byte_bucket(unsigned char c) const { return m_first_byte_buckets[c]; }
+    Size distinct_first_byte_count() const { return m_distinct_first_byte_count; }
+    unsigned char single_first_byte() const { return m_single_first_byte; }
+
+    Kernel literal_kernel(Size file_length) const {
+        if (m_literals.size() > 1) {
+            return Kernel::MultiLiteral;
+        }
+        // Boyer-Moore only pays for its tables with longer needles on larger files
+        if (file_length >= SmallFileLength && m_literals.front().length() >= BoyerMooreMinimumNeedleLength) {
+            return Kernel::BoyerMoore;
+        }
+        return Kernel::Memchr;
+    }
+
+    Kernel regex_kernel(Size regex_index) const {
+        if (m_multiline) {
+            return Kernel::MultilineRegex;
+        }
+        return m_regex_prefilters[regex_index].is_empty() ? Kernel::Regex : Kernel::PrefilteredRegex;
+    }
+
+    String to_string() const {
+        String result;
+        if (m_literals.size() > 0) {
+            result += std::to_string(m_literals.size());
+            result += m_literals.size() == 1 ? " literal needle: " : " literal needles: ";
+            if (m_literals.size() > 1) {
+                result += kernel_name(Kernel::MultiLiteral);
+            }
+            else {
+                result += kernel_name(Kernel::Memchr);
+                unsigned char rare_byte = m_literals.front().text()[m_literals.front().rare_byte_offset()];
+                if (isprint(rare_byte)) {
+                    result += " on byte '";
+                    result += rare_byte;
+                    result += "'";
+                }
+                else {
+                    char hex[8];
+                    snprintf(hex, sizeof(hex), "0x%02x", rare_byte);
+                    result += " on byte ";
+                    result += hex;
+                }
+                if (m_literals.front().length() >= BoyerMooreMinimumNeedleLength) {
+                    result += ", ";
+                    result += kernel_name(Kernel::BoyerMoore);
+                    result += " for files of ";
+                    result += std::to_string(SmallFileLength);
+                    result += " bytes or more";
+                }
+            }
+            if (m_folds_unicode) {
+                result += " over Unicode case-folded text";
+            }
+            else if (m_folds_haystack) {
+                result += " over ASCII case-folded text";
+            }
+            if (has_exclusions()) {
+                result += ", ";
+                result += std::to_string(m_literals.size() - m_string_needle_count);
+                result += " of them excluding lines";
+            }
+        }
+        for (Size idx = 0; idx < m_regex_prefilters.size(); idx++) {
+            if (result.length() > 0) {
+                result += "; ";
+            }
+            result += "regex needle ";
+            result += std::to_string(idx + 1);
+            result += ": ";
+            result += kernel_name(regex_kernel(idx));
+            if (!m_regex_prefilters[idx].is_empty()) {
+                result += m_multiline ? " skipping ahead by \"" : " by \"";
+                result += m_regex_prefilters[idx].text();
+                result += "\"";
+            }
+        }
+        return result;
+    }
+
+private:
+    std::vector<LiteralNeedle> m_literals;
+    std::vector<LiteralNeedle> m_regex_prefilters;
+    std::vector<TrigramQuery> m_trigram_queries;
+    Size m_string_needle_count = 0;
+    Size m_needle_count = 0;
+    bool m_folds_haystack = false;
+    bool m_folds_unicode = false;
+    bool m_multiline = false;
+    std::array<bool, 256> m_first_bytes;
+    std::array<std::vector<Size>, 256> m_first_byte_buckets;
+    Size m_distinct_first_byte_count = 0;
+    unsigned char m_single_first_byte = 0;
+    std::shared_ptr<const QueryPlan> m_utf16le_plan;
+    std::shared_ptr<const QueryPlan> m_utf16be_plan;
+};
+
+class Stats
+{
+public:
+    void add_searched_file(Size length) {
+        m_files_searched++;
+        m_bytes_searched += length;
+    }
+    void add_binary_file() { m_binary_files_skipped++; }
+    void add_cancelled_file() { m_files_cancelled++; }
+    void add_minified_file() { m_minified_files++; }
+    void add_utf16_file() { m_utf16_files++; }
+    void add_index_skipped_file() { m_index_skipped_files++; }
+    void add_line_table_file() { m_line_table_files++; }
+    void add_kernel_use(Kernel kernel) { m_kernel_uses[static_cast<Size>(kernel)]++; }
+
+    String to_string(const QueryPlan &plan) const {
+        String result;
+        result += "plan: ";
+        result += plan.to_string();
+        result += "\nfiles: ";
+        result += std::to_string(m_files_searched.load());
+        result += " searched, ";
+        result += std::to_string(m_binary_files_skipped.load());
+        result += " skipped as binary, ";
+        result += std::to_string(m_files_cancelled.load());
+        result += " cancelled, ";
+        result += std::to_string(m_minified_files.load());
+        result += " minified, ";
+        result += std::to_string(m_utf16_files.load());
+        result += " utf-16, ";
+        result += std::to_string(m_index_skipped_files.load());
+        result += " skipped by index or filters, ";
+        result += std::to_string(m_line_table_files.load());
+        result += " with cached line tables\nbytes: ";
+        result += std::to_string(m_bytes_searched.load());
+        result += " searched\nkernels:";
+        for (Size idx = 0; idx < KernelCount; idx++) {
+            Size uses = m_kernel_uses[idx].load();
+            if (uses > 0) {
+                result += " ";
+                result += kernel_name(static_cast<Kernel>(idx));
+                result += "=";
+                result += std::to_string(uses);
+            }
+        }
+        return result;
+    }
+
+private:
+    std::atomic<Size> m_files_searched = 0;
+    std::atomic<Size> m_binary_files_skipped = 0;
+    std::atomic<Size> m_files_cancelled = 0;
+    std::atomic<Size> m_minified_files = 0;
+    std::atomic<Size> m_utf16_files = 0;
+    std::atomic<Size> m_index_skipped_files = 0;
+    std::atomic<Size> m_line_table_files = 0;
+    std::atomic<Size> m_bytes_searched = 0;
+    std::array<std::atomic<Size>, KernelCount> m_kernel_uses = {};
+};
+
+Stats g_stats;
+
+// Decides when enough results have been found to cancel the rest of the search.
+// In file order, the search is cut off after the first files, in walk order,
+// that together have enough results, so the output is the same from run to run.
+// In fastest order, everything is cancelled once any files have enough results.
+// Call add_file and file_completed while holding g_lock.
+class Limiter
+{
+public:
+    void set_limit(Size limit, LimitOrder order) {
+        m_limit = limit;
+        m_order = order;
+    }
+
+    Size limit() const { return m_limit; }
+    bool has_limit() const { return m_limit > 0; }
+
+    bool is_cancelled(Size file_index) const {
+        return m_cancelled.load(std::memory_order_relaxed) || file_index > m_cutoff.load(std::memory_order_relaxed);
+    }
+
+    void cancel() { m_cancelled = true; }
+
+    void add_file() {
+        m_ref_counts.push_back(String::npos);
+    }
+
+    void file_completed(Size file_index, Size ref_count) {
+        if (!has_limit()) {
+            return;
+        }
+        if (m_order == LimitOrder::Fastest) {
+            m_ref_count += ref_count;
+            if (m_ref_count >= m_limit) {
+                cancel();
+            }
+            return;
+        }
+        m_ref_counts[file_index] = ref_count;
+        while (m_completed_count < m_ref_counts.size() && m_ref_counts[m_completed_count] != String::npos) {
+            m_ref_count += m_ref_counts[m_completed_count];
+            m_completed_count++;
+            if (m_ref_count >= m_limit) {
+                m_cutoff = m_completed_count - 1;
+                break;
+            }
+        }
+    }
+
+private:
+    Size m_limit = 0;
+    LimitOrder m_order = LimitOrder::FileOrder;
+    std::atomic<bool> m_cancelled = false;
+    std::atomic<Size> m_cutoff = String::npos;
+    std::vector<Size> m_ref_counts;
+    Size m_completed_count = 0;
+    Size m_ref_count = 0;
+};
+
+Limiter g_limiter;
+
+class Env
+{
+public:
+    Env(const fs::path &current_path,
+        const std::vector<String> &string_needles,
+        const std::vector<std::regex> &regex_needles,
+        const QueryPlan &plan,
+        const String &replacement,
+        PreserveCase preserve_case,
+        TextRef::FilenameFormat filename_format,
+        HighlightColor highlight_color,
+        MatchType match_type,
+        Size within_lines,
+        MergeSpreads merge_spreads,
+        Mode mode,
+        Report report,
+        NeedleFormat needle_format,
+        Size max_count,
+        Size before_context,
+        Size after_context,
+        Size max_columns,
+        SkipMinified skip_minified,
+        ColumnUnit column_unit,
+        SearchCase search_case,
+        Skip skip,
+        LimitToSearchables limit_to_searchables,
+        ShowStats show_stats) :
+        m_current_path(current_path),
+        m_string_needles(string_needles),
+        m_regex_needles(regex_needles),
+        m_plan(plan),
+        m_replacement(replacement),
+        m_preserve_case(preserve_case),
+        m_filename_format(filename_format),
+        m_highlight_color(highlight_color),
+        m_match_type(match_type),
+        m_within_lines(within_lines),
+        m_merge_spreads(merge_spreads),
+        m_mode(mode),
+        m_report(report),
+        m_needle_format(needle_format),
+        m_max_count(max_count),
+        m_before_context(before_context),
+        m_after_context(after_context),
+        m_max_columns(max_columns),
+        m_skip_minified(skip_minified),
+        m_column_unit(column_unit),
+        m_search_case(search_case),
+        m_skip(skip),
+        m_limit_to_searchables(limit_to_searchables),
+        m_show_stats(show_stats)
+    {}
+
+    const fs::path &current_path() const { return m_current_path; }
+    const std::vector<String> &string_needles() const { return m_string_needles; }
+    const std::vector<std::regex> &regex_needles() const { return m_regex_needles; }
+    const QueryPlan &plan() const { return m_plan; }
+    const String &replacement() const { return m_replacement; }
+    PreserveCase preserve_case() const { return m_preserve_case; }
+    TextRef::FilenameFormat filename_format() const { return m_filename_format; }
+    HighlightColor highlight_color() const { return m_highlight_color; }
+    MatchType match_type() const { return m_match_type; }
+    Size within_lines() const { return m_within_lines; }
+    MergeSpreads merge_spreads() const { return m_merge_spreads; }
+    Mode mode() const { return m_mode; }
+    Report report() const { return m_report; }
+    NeedleFormat needle_format() const { return m_needle_format; }
+    Size max_count() const { return m_max_count; }
+    Size before_context() const { return m_before_context; }
+    Size after_context() const { return m_after_context; }
+    Size max_columns() const { return m_max_columns; }
+    SkipMinified skip_minified() const { return m_skip_minified; }
+    ColumnUnit column_unit() const { return m_column_unit; }
+    SearchCase search_case() const { return m_search_case; }
+    Skip skip() const { return m_skip; }
+    LimitToSearchables limit_to_searchables() const { return m_limit_to_searchables; }
+    ShowStats show_stats() const { return m_show_stats; }
+
+private:
+    fs::path m_current_path;
+    std::vector<String> m_string_needles;
+    std::vector<std::regex> m_regex_needles;
+    QueryPlan m_plan;
+    String m_replacement;
+    PreserveCase m_preserve_case;
+    TextRef::FilenameFormat m_filename_format;
+    HighlightColor m_highlight_color;
+    MatchType m_match_type;
+    Size m_within_lines;
+    MergeSpreads m_merge_spreads;
+    Mode m_mode;
+    Report m_report;
+    NeedleFormat m_needle_format;
+    Size m_max_count;
+    Size m_before_context;
+    Size m_after_context;
+    Size m_max_columns;
+    SkipMinified m_skip_minified;
+    ColumnUnit m_column_unit;
+    SearchCase m_search_case;
+    Skip m_skip;
+    LimitToSearchables m_limit_to_searchables;
+    ShowStats m_show_stats;
+};
+
+static HighlightColor highlight_color_from_string(const String &s)
+{
+    std::map<String, HighlightColor> highlight_colors = {
+        {"black", HighlightColor::Black},
+        {"gray", HighlightColor::Gray},
+        {"red", HighlightColor::Red},
+        {"green", HighlightColor::Green},
+        {"yellow", HighlightColor::Yellow},
+        {"blue", HighlightColor::Blue},
+        {"magenta", HighlightColor::Magenta},
+        {"cyan", HighlightColor::Cyan},
+        {"white", HighlightColor::White},
+    };
+
+    const auto r = highlight_colors.find(s);
+    return r == highlight_colors.end() ? HighlightColor::None : r->second;
+}
+
+// Walks the directory tree depth first, visiting each directory's entries in sorted
+// order so files are always found in the same order. Stops if visit returns false.
+static bool walk_files(const Env &env, const fs::path &dir, const std::function<bool(const fs::path &)> &visit)
+{
+    std::vector<fs::directory_entry> entries;
+    std::error_code error;
+    fs::directory_options options = fs::directory_options::skip_permission_denied;
+    for (auto it = fs::directory_iterator(dir, options, error); !error && it != fs::directory_iterator(); it.increment(error)) {
+        entries.push_back(*it);
+    }
+    std::sort(entries.begin(), entries.end(), [](const fs::directory_entry &a, const fs::directory_entry &b) {
+        return a.path().filename() < b.path().filename();
+    });
+
+    for (const auto &dir_entry : entries) {
+        const fs::path &path = dir_entry.path();
+        if (dir_entry.is_directory()) {
+            if (dir_entry.is_symlink() || (env.skip() == Skip::SkipSkippables && UU::is_skippable(UU::skippable_paths(), path))) {
+                continue;
+            }
+            if (!walk_files(env, path, visit)) {
+                return false;
+            }
+            continue;
+        }
+        if (!dir_entry.is_regular_file()) {
+            continue;
+        }
+        if (env.limit_to_searchables() == LimitToSearchables::No || UU::is_searchable(UU::searchable_paths(), path)) {
+            if (!visit(path)) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+class Match
+{
+public:
+    Match() {}
+    Match(Size needle_index, Size match_start_index, Size match_length) : 
+        m_needle_index(needle_index), m_spread(match_start_index, match_start_index + match_length) {}
+
+    Size needle_index() const { return m_needle_index; }
+    void set_needle_index(Size needle_index) { m_needle_index = needle_index; }
+
+    Size match_start_index() const { return m_spread.first(); }
+
+    const Spread<Size> &spread() const { return m_spread; }
+    void add_spread(const Spread<Size> &spread) { m_spread.add(spread); }
+    void simplify_spread() { m_spread.simplify(); }
+
+    Size line_start_index() const { return m_line_start_index; }
+    void set_line_start_index(Size line_start_index) { m_line_start_index = line_start_index; }
+
+    Size line_length() const { return m_line_length; }
+    void set_line_length(Size line_length) { m_line_length = line_length; }
+
+    Size line() const { return m_line; }
+    void set_line(Size line) { m_line = line; }
+
+    Size column() const { return match_start_index() - m_line_start_index; }
+
+private:
+    Size m_needle_index = 0;
+    Spread<Size> m_spread;
+    Size m_line_start_index = 0;
+    Size m_line_length = 0;
+    Size m_line = 0;
+};
+
+static Size newline_length(Encoding encoding)
+{
+    return encoding == Encoding::UTF8 ? 1 : 2;
+}
+
+// Returns true if there's a newline character at idx, which for UTF-16 must be the start of a unit
+static bool is_newline_at(StringView text, Size idx, Encoding encoding)
+{
+    switch (encoding) {
+        case Encoding::UTF16LE:
+            return text[idx] == '\n' && text[idx + 1] == '\0';
+        case Encoding::UTF16BE:
+            return text[idx] == '\0' && text[idx + 1] == '\n';
+        default:
+            return text[idx] == '\n';
+    }
+}
+
+// Returns the index of the first newline at or after the given index, or the length of the text.
+// In UTF-16, memchr finds the newline byte and the unit it's in is checked. Indexes into UTF-16
+// text are always at the start of a unit, counting from the start of the text.
+static Size find_newline(StringView text, Size from, Encoding encoding)
+{
+    const char *data = text.data();
+    const Size length = text.length();
+    Size pos = from;
+    while (pos < length) {
+        const char *newline = (const char *)memchr(data + pos, '\n', length - pos);
+        if (newline == nullptr) {
+            break;
+        }
+        Size idx = newline - data;
+        if (encoding == Encoding::UTF8) {
+            return idx;
+        }
+        // the newline byte comes second in a big-endian unit, so the unit can't start before from
+        bool in_range = encoding == Encoding::UTF16LE ? idx + 2 <= length : idx > from;
+        Size unit_start = encoding == Encoding::UTF16LE ? idx : idx - 1;
+        if (in_range && unit_start % 2 == 0 && is_newline_at(text, unit_start, encoding)) {
+            return unit_start;
+        }
+        pos = idx + 1;
+    }
+    return length;
+}
+
+// Returns the start of the line that ends at the given index
+static Size find_line_start(StringView text, Size line_end, Encoding encoding)
+{
+    const Size unit = newline_length(encoding);
+    Size pos = line_end;
+    while (pos >= unit) {
+        if (is_newline_at(text, pos - unit, encoding)) {
+            return pos;
+        }
+        pos -= unit;
+    }
+    return 0;
+}
+
+// Lines are sampled for the cached line tables once every this many lines
+static constexpr Size LineSampleInterval = 32;
+
+// Finds the line containing each of a series of non-decreasing indexes,
+// scanning forward for newlines only as far as needed. Given the sampled
+// line starts of a cached line table, it jumps to the last sampled line
+// before an index instead, and scans from there.
+class LineScanner
+{
+public:
+    LineScanner(StringView haystack, Encoding encoding = Encoding::UTF8, const std::vector<Size> *line_samples = nullptr) : 
+        m_haystack(haystack), m_encoding(encoding), m_line_samples(line_samples) { 
+        find_line_end(); 
+    }
+
+    void advance_to(Size index) {
+        if (m_line_end < index && m_line_samples != nullptr && m_line_samples->size() > 0) {
+            jump_toward(index);
+        }
+        while (m_line_end < index) {
+            m_line_start = m_line_end + newline_length(m_encoding);
+            m_line++;
+            find_line_end();
+        }
+    }
+
+    Size line() const { return m_line; }
+    Size line_start() const { return m_line_start; }
+    Size line_end() const { return m_line_end; }
+    Size line_length() const { return m_line_end - m_line_start; }
+
+private:
+    void find_line_end() {
+        m_line_end = find_newline(m_haystack, m_line_start, m_encoding);
+    }
+
+    void jump_toward(Size index) {
+        const std::vector<Size> &samples = *m_line_samples;
+        Size sample = std::upper_bound(samples.begin(), samples.end(), index) - samples.begin() - 1;
+        Size line = 1 + sample * LineSampleInterval;
+        if (line > m_line) {
+            m_line = line;
+            m_line_start = samples[sample];
+            find_line_end();
+        }
+    }
+
+    StringView m_haystack;
+    Encoding m_encoding;
+    const std::vector<Size> *m_line_samples;
+    Size m_line = 1;
+    Size m_line_start = 0;
+    Size m_line_end = 0;
+};
+
+static constexpr Size BinarySniffLength = 1024;
+
+// A NUL byte near the start of a file is a reliable enough sign that it's not text
+static bool is_binary(StringView source)
+{
+    Size sniff_length = std::min(source.length(), BinarySniffLength);
+    return memchr(source.data(), '\0', sniff_length) != nullptr;
+}
+
+// Recognizes a byte order mark, setting bom_length to its length, or failing that, UTF-16
+// without one. Text that's mostly ASCII has a NUL in the high byte of most units, and
+// hardly any in the low byte, which binary files are very unlikely to match.
+static Encoding sniff_encoding(StringView source, Size &bom_length)
+{
+    bom_length = 0;
+    if (source.length() >= 3 && memcmp(source.data(), "\xEF\xBB\xBF", 3) == 0) {
+        bom_length = 3;
+        return Encoding::UTF8;
+    }
+    if (source.length() >= 2 && memcmp(source.data(), "\xFF\xFE", 2) == 0) {
+        bom_length = 2;
+        return Encoding::UTF16LE;
+    }
+    if (source.length() >= 2 && memcmp(source.data(), "\xFE\xFF", 2) == 0) {
+        bom_length = 2;
+        return Encoding::UTF16BE;
+    }
+
+    Size unit_count = std::min(source.length(), BinarySniffLength) / 2;
+    if (unit_count < 2) {
+        return Encoding::UTF8;
+    }
+    Size first_byte_nuls = 0;
+    Size second_byte_nuls = 0;
+    for (Size idx = 0; idx < unit_count; idx++) {
+        first_byte_nuls += source[idx * 2] == '\0';
+        second_byte_nuls += source[idx * 2 + 1] == '\0';
+    }
+    if (first_byte_nuls * 20 <= unit_count && second_byte_nuls * 4 >= unit_count * 3) {
+        return Encoding::UTF16LE;
+    }
+    if (second_byte_nuls * 20 <= unit_count && first_byte_nuls * 4 >= unit_count * 3) {
+        return Encoding::UTF16BE;
+    }
+    return Encoding::UTF8;
+}
+
+static constexpr Size MinifiedSniffLength = 64 * 1024;
+static constexpr Size MinifiedAverageLineLength = 500;
+static constexpr Size MinifiedMaxColumns = 160;
+
+// Minified and generated files put huge amounts of text on each line. Checking the
+// average line length at the start of the file is enough to spot them before a scan.
+static bool looks_minified(StringView source)
+{
+    Size sniff_length = std::min(source.length(), MinifiedSniffLength);
+    if (sniff_length <= MinifiedAverageLineLength) {
+        return false;
+    }
+    Size line_count = 1;
+    const char *ptr = source.data();
+    const char *end = source.data() + sniff_length;
+    while ((ptr = (const char *)memchr(ptr, '\n', end - ptr)) != nullptr) {
+        line_count++;
+        ptr++;
+    }
+    return sniff_length / line_count > MinifiedAverageLineLength;
+}
+
+// A trigram index of the files under a directory, written by search --build-index to
+// .search-index at the top of the tree and mapped by later searches run from there.
+// The layout, in order: a header, a table of files sorted by relative path, a table
+// of trigrams sorted by value, the compressed posting list of file ids for each
+// trigram, and the file paths. Each file has a fingerprint of its size and modification
+// time, so a file that has changed since the index was built is always searched.
+static constexpr const char *IndexFilename = ".search-index";
+
+// Per-file Bloom filters, a lighter alternative to the index, written by search --build-filters
+static constexpr const char *FiltersFilename = ".search-filters";
+
+// Cached line starts, written by search --line-tables alongside either of them
+static constexpr const char *LinesFilename = ".search-lines";
+
+// Where names are defined, written by search --build-defs
+static constexpr const char *DefsFilename = ".search-defs";
+static constexpr char IndexMagic[8] = { 'S', 'R', 'C', 'H', 'I', 'D', 'X', '2' };
+
+struct IndexHeader
+{
+    char magic[8];
+    UInt32 file_count;
+    UInt32 trigram_count;
+    UInt64 postings_offset;
+    UInt64 paths_offset;
+};
+
+// UTF-16 files are matched against transcoded needles, which the trigrams of
+// their raw bytes can't answer for, so they're always searched
+enum IndexFileFlags : UInt32 { IndexFileAlwaysSearch = 1 };
+
+struct IndexFileEntry
+{
+    UInt64 size;
+    Int64 modified;
+    UInt32 path_offset;
+    UInt32 flags;
+};
+
+struct IndexTrigramEntry
+{
+    UInt32 trigram;
+    UInt32 count;
+    UInt64 offset;
+};
+
+// Posting lists are delta-encoded with group varint. Each group of four deltas starts with
+// a control byte holding the byte length of each delta, less one, in two bits, and the
+// deltas follow in that many little-endian bytes. A list is split into blocks of
+// PostingBlockLength ids, and a skip table in front of the data holds the last id of
+// each block and where its data starts, so an intersection can pass over whole blocks
+// without decoding them. A list with only one block has no skip table.
+static constexpr Size PostingBlockLength = 128;
+static constexpr Size PostingGroupLength = 4;
+
+// the decoder reads four bytes for every delta, so this much padding follows the last list
+static constexpr Size PostingPaddingLength = 3;
+
+struct PostingSkip
+{
+    UInt32 last_id;
+    UInt32 offset;
+};
+
+static void encode_postings(const UInt32 *ids, Size count, std::string &output)
+{
+    const Size block_count = (count + PostingBlockLength - 1) / PostingBlockLength;
+    const Size skips_start = output.length();
+    const Size skips_length = block_count > 1 ? block_count * sizeof(PostingSkip) : 0;
+    output.resize(skips_start + skips_length);
+    const Size data_start = output.length();
+
+    UInt32 previous = 0;
+    for (Size block = 0; block < block_count; block++) {
+        Size first = block * PostingBlockLength;
+        Size end = std::min(first + PostingBlockLength, count);
+        if (skips_length > 0) {
+            PostingSkip skip = { ids[end - 1], UInt32(output.length() - data_start) };
+            memcpy(&output[skips_start + block * sizeof(PostingSkip)], &skip, sizeof(skip));
+        }
+
+        // a short last group is filled out with zero deltas
+        for (Size group = first; group < end; group += PostingGroupLength) {
+            Size control_index = output.length();
+            output += '\0';
+            unsigned char control = 0;
+            for (Size idx = 0; idx < PostingGroupLength; idx++) {
+                UInt32 delta = 0;
+                if (group + idx < end) {
+                    delta = ids[group + idx] - previous;
+                    previous = ids[group + idx];
+                }
+                Size length = delta < (1U << 8) ? 1 : (delta < (1U << 16) ? 2 : (delta < (1U << 24) ? 3 : 4));
+                control |= (length - 1) << (idx * 2);
+                for (Size byte = 0; byte < length; byte++) {
+                    output += char((delta >> (byte * 8)) & 0xFF);
+                }
+            }
+            output[control_index] = control;
+        }
+    }
+}
+
+// The byte offset of each delta in a group, and the length of the group, for every control byte
+struct PostingGroupLayout
+{
+    unsigned char offsets[PostingGroupLength];
+    unsigned char length;
+};
+
+static constexpr std::array<PostingGroupLayout, 256> make_posting_group_layouts()
+{
+    std::array<PostingGroupLayout, 256> layouts = {};
+    for (Size control = 0; control < 256; control++) {
+        unsigned char offset = 1;
+        for (Size idx = 0; idx < PostingGroupLength; idx++) {
+            layouts[control].offsets[idx] = offset;
+            offset += ((control >> (idx * 2)) & 3) + 1;
+        }
+        layouts[control].length = offset;
+    }
+    return layouts;
+}
+
+static constexpr std::array<PostingGroupLayout, 256> PostingGroupLayouts = make_posting_group_layouts();
+
+// Decodes one group without branching on the lengths. The control byte looks up where each
+// delta starts, so the four reads don't wait on each other, and each is read as four bytes
+// and masked down to its length. Index files are little-endian, like the machines that
+// make them.
+static const unsigned char *decode_posting_group(const unsigned char *input, UInt32 &previous, UInt32 *output)
+{
+    static constexpr UInt32 masks[4] = { 0xFF, 0xFFFF, 0xFFFFFF, 0xFFFFFFFF };
+    const unsigned char control = input[0];
+    const PostingGroupLayout &layout = PostingGroupLayouts[control];
+    UInt32 deltas[PostingGroupLength];
+    for (Size idx = 0; idx < PostingGroupLength; idx++) {
+        memcpy(&deltas[idx], input + layout.offsets[idx], sizeof(UInt32));
+        deltas[idx] &= masks[(control >> (idx * 2)) & 3];
+    }
+    for (Size idx = 0; idx < PostingGroupLength; idx++) {
+        previous += deltas[idx];
+        output[idx] = previous;
+    }
+    return input + layout.length;
+}
+
+// Returns true if a posting list of count ids fits in the length bytes at data: every skip
+// points where its block starts, and every group ends within the list. The decoder's reads
+// past the end of a list land in the list after it or in the padding after the last one.
+static bool is_well_formed_posting_list(const char *data, Size count, Size length)
+{
+    const unsigned char *input = (const unsigned char *)data;
+    const Size block_count = (count + PostingBlockLength - 1) / PostingBlockLength;
+    const Size skips_length = block_count > 1 ? block_count * sizeof(PostingSkip) : 0;
+    if (skips_length > length) {
+        return false;
+    }
+    Size position = skips_length;
+    for (Size block = 0; block < block_count; block++) {
+        if (skips_length > 0) {
+            PostingSkip skip;
+            memcpy(&skip, input + block * sizeof(PostingSkip), sizeof(skip));
+            if (skip.offset != position - skips_length) {
+                return false;
+            }
+        }
+        Size block_length = std::min(PostingBlockLength, count - block * PostingBlockLength);
+        for (Size idx = 0; idx < block_length; idx += PostingGroupLength) {
+            if (position >= length) {
+                return false;
+            }
+            position += PostingGroupLayouts[input[position]].length;
+            if (position > length) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+class PostingList
+{
+public:
+    PostingList() {}
+    PostingList(const char *data, Size count) : m_data((const unsigned char *)data), m_count(count) {}
+
+    Size count() const { return m_count; }
+    bool is_empty() const { return m_count == 0; }
+    Size block_count() const { return (m_count + PostingBlockLength - 1) / PostingBlockLength; }
+
+    // Only lists with more than one block have skips
+    PostingSkip skip(Size block) const {
+        PostingSkip result;
+        memcpy(&result, m_data + block * sizeof(PostingSkip), sizeof(result));
+        return result;
+    }
+
+    // Decodes a block into output, which must have room for PostingBlockLength ids.
+    // Returns the number of ids in the block.
+    Size decode_block(Size block, UInt32 *output) const {
+        const unsigned char *input = m_data;
+        if (block_count() > 1) {
+            input += block_count() * sizeof(PostingSkip) + skip(block).offset;
+        }
+        UInt32 previous = block == 0 ? 0 : skip(block - 1).last_id;
+        Size length = std::min(PostingBlockLength, m_count - block * PostingBlockLength);
+        for (Size idx = 0; idx < length; idx += PostingGroupLength) {
+            input = decode_posting_group(input, previous, output + idx);
+        }
+        return length;
+    }
+
+    std::vector<UInt32> decode() const {
+        std::vector<UInt32> ids(block_count() * PostingBlockLength);
+        for (Size block = 0; block < block_count(); block++) {
+            decode_block(block, ids.data() + block * PostingBlockLength);
+        }
+        ids.resize(m_count);
+        return ids;
+    }
+
+private:
+    const unsigned char *m_data = nullptr;
+    Size m_count = 0;
+};
+
+// Walks a posting list in order, decoding a block at a time
+class PostingCursor
+{
+public:
+    PostingCursor(const PostingList &list) : m_list(list) { load_block(0); }
+
+    Size count() const { return m_list.count(); }
+    bool is_at_end() const { return m_block >= m_list.block_count(); }
+    UInt32 value() const { return m_ids[m_position]; }
+
+    void next() {
+        if (++m_position >= m_length) {
+            load_block(m_block + 1);
+        }
+    }
+
+    // Moves to the first id at or after the target, skipping blocks that end before it
+    void advance_to(UInt32 target) {
+        if (is_at_end() || value() >= target) {
+            return;
+        }
+        if (m_ids[m_length - 1] < target) {
+            Size block = m_block + 1;
+            while (block < m_list.block_count() && m_list.skip(block).last_id < target) {
+                block++;
+            }
+            load_block(block);
+            if (is_at_end()) {
+                return;
+            }
+        }
+        m_position = std::lower_bound(m_ids.begin() + m_position, m_ids.begin() + m_length, target) - m_ids.begin();
+    }
+
+private:
+    void load_block(Size block) {
+        m_block = block;
+        m_position = 0;
+        m_length = is_at_end() ? 0 : m_list.decode_block(block, m_ids.data());
+    }
+
+    PostingList m_list;
+    Size m_block = 0;
+    Size m_position = 0;
+    Size m_length = 0;
+    std::array<UInt32, PostingBlockLength> m_ids;
+};
+
+// Intersects posting lists by leapfrogging. The shortest list proposes each id, and the
+// others skip ahead to it, passing over whole blocks where they can.
+static std::vector<UInt32> intersect_postings(std::vector<PostingCursor> &cursors)
+{
+    std::vector<UInt32> result;
+    if (cursors.empty()) {
+        return result;
+    }
+    std::sort(cursors.begin(), cursors.end(), [](const PostingCursor &a, const PostingCursor &b) {
+        return a.count() < b.count();
+    });
+    PostingCursor &lead = cursors.front();
+    while (!lead.is_at_end()) {
+        UInt32 candidate = lead.value();
+        bool in_all = true;
+        for (Size idx = 1; idx < cursors.size(); idx++) {
+            PostingCursor &cursor = cursors[idx];
+            cursor.advance_to(candidate);
+            if (cursor.is_at_end()) {
+                return result;
+            }
+            if (cursor.value() != candidate) {
+                lead.advance_to(cursor.value());
+                in_all = false;
+                break;
+            }
+        }
+        if (in_all) {
+            result.push_back(candidate);
+            lead.next();
+        }
+    }
+    return result;
+}
+
+// Returns the size and modification time that identify a version of a file
+static bool file_fingerprint(const fs::path &filename, UInt64 &size, Int64 &modified)
+{
+    std::error_code error;
+    size = fs::file_size(filename, error);
+    if (error) {
+        return false;
+    }
+    modified = fs::last_write_time(filename, error).time_since_epoch().count();
+    return !error;
+}
+
+// The path of a walked file relative to the top of the tree, as the index stores it
+static StringView index_relative_path(const fs::path &filename, const fs::path &current_path)
+{
+    StringView path = filename.native();
+    StringView prefix = current_path.native();
+    if (path.length() <= prefix.length() + 1 || path.substr(0, prefix.length()) != prefix) {
+        return StringView();
+    }
+    return path.substr(prefix.length() + 1);
+}
+
+// Index files of every kind are never searched or indexed themselves, nor are the new
+// versions being written to replace them
+static bool is_index_file(const fs::path &filename)
+{
+    fs::path name = filename.filename();
+    if (name.extension() == ".new") {
+        name = name.stem();
+    }
+    return name == IndexFilename || name == FiltersFilename || name == LinesFilename || name == DefsFilename;
+}
+
+// Returns true if count entries of entry_length bytes, starting at offset, fit in length bytes.
+// Index files are checked with this before their tables are used, so a damaged or truncated
+// file is taken as missing rather than read past its end.
+static bool fits_within(UInt64 offset, UInt64 count, UInt64 entry_length, UInt64 length)
+{
+    return offset <= length && count <= (length - offset) / entry_length;
+}
+
+// Writes an index file beside the one it replaces and renames it into place, so a search that
+// has the old one mapped, or starts while the new one is written, never sees a partial file
+template <typename Write>
+static bool write_index_file(const fs::path &path, Write write)
+{
+    const fs::path new_path = path.string() + ".new";
+    std::ofstream file(new_path, std::ios::binary);
+    write(file);
+    file.close();
+    std::error_code error;
+    if (!file.fail()) {
+        fs::rename(new_path, path, error);
+    }
+    if (file.fail() || error) {
+        fs::remove(new_path, error);
+        return false;
+    }
+    return true;
+}
+
+// Sorted file ids, or every file when is_all is set
+struct FileIdSet
+{
+    bool is_all = false;
+    std::vector<UInt32> ids;
+};
+
+// The files an index knows about, sorted by relative path, with the fingerprint of the
+// version of each that was indexed
+class IndexedFiles
+{
+public:
+    IndexedFiles() {}
+    IndexedFiles(const IndexFileEntry *files, UInt32 count, const char *paths, Size paths_length) :
+        m_files(files), m_count(count), m_paths(paths), m_paths_length(paths_length) {}
+
+    Size count() const { return m_count; }
+
+    // Returns true if every path starts within the paths, and the last of them ends there too
+    bool is_well_formed() const {
+        if (m_count == 0) {
+            return true;
+        }
+        if (m_paths_length == 0 || m_paths[m_paths_length - 1] != '\0') {
+            return false;
+        }
+        for (Size id = 0; id < m_count; id++) {
+            if (m_files[id].path_offset >= m_paths_length) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    const IndexFileEntry &entry(UInt32 id) const { return m_files[id]; }
+
+    StringView path(UInt32 id) const { return StringView(m_paths + m_files[id].path_offset); }
+
+    // Returns the id of the file with the given relative path, or String::npos
+    Size find(StringView relative_path) const {
+        UInt32 low = 0;
+        UInt32 high = m_count;
+        while (low < high) {
+            UInt32 mid = low + (high - low) / 2;
+            if (path(mid) < relative_path) {
+                low = mid + 1;
+            }
+            else {
+                high = mid;
+            }
+        }
+        return low < m_count && path(low) == relative_path ? low : String::npos;
+    }
+
+    // Returns true if the file is the same as when it was indexed, and can be judged by its trigrams
+    bool is_current(UInt32 id, const fs::path &filename) const {
+        const IndexFileEntry &entry = m_files[id];
+        if (entry.flags & IndexFileAlwaysSearch) {
+            return false;
+        }
+        UInt64 size = 0;
+        Int64 modified = 0;
+        return file_fingerprint(filename, size, modified) && size == entry.size && modified == entry.modified;
+    }
+
+private:
+    const IndexFileEntry *m_files = nullptr;
+    UInt32 m_count = 0;
+    const char *m_paths = nullptr;
+    Size m_paths_length = 0;
+};
+
+class ContentIndex
+{
+public:
+    bool load(const fs::path &path) {
+        m_mapped_file = std::make_unique<MappedFile>(path);
+        if (m_mapped_file->is_valid<false>() || m_mapped_file->file_length() < sizeof(IndexHeader)) {
+            return false;
+        }
+        m_base = (const char *)m_mapped_file->base();
+        m_header = (const IndexHeader *)m_base;
+        if (memcmp(m_header->magic, IndexMagic, sizeof(IndexMagic)) != 0) {
+            return false;
+        }
+        const UInt64 length = m_mapped_file->file_length();
+        const UInt64 trigrams_offset = sizeof(IndexHeader) + UInt64(m_header->file_count) * sizeof(IndexFileEntry);
+        if (!fits_within(sizeof(IndexHeader), m_header->file_count, sizeof(IndexFileEntry), length) ||
+            !fits_within(trigrams_offset, m_header->trigram_count, sizeof(IndexTrigramEntry), m_header->postings_offset) ||
+            !fits_within(m_header->postings_offset, PostingPaddingLength, 1, m_header->paths_offset) ||
+            m_header->paths_offset > length) {
+            return false;
+        }
+        const IndexFileEntry *files = (const IndexFileEntry *)(m_base + sizeof(IndexHeader));
+        m_files = IndexedFiles(files, m_header->file_count, m_base + m_header->paths_offset,
+            length - m_header->paths_offset);
+        if (!m_files.is_well_formed()) {
+            return false;
+        }
+        m_trigrams = (const IndexTrigramEntry *)(m_base + trigrams_offset);
+        m_postings = m_base + m_header->postings_offset;
+        m_postings_length = m_header->paths_offset - m_header->postings_offset - PostingPaddingLength;
+        return true;
+    }
+
+    // Set when a posting list turns out to be damaged, after which the index can't be trusted
+    bool is_damaged() const { return m_is_damaged; }
+
+    Size file_count() const { return m_files.count(); }
+    Size trigram_count() const { return m_header->trigram_count; }
+
+    const IndexedFiles &files() const { return m_files; }
+
+    // Returns the number of files containing the trigram, without checking its list
+    Size posting_count(UInt32 trigram) const {
+        const IndexTrigramEntry *entry = find_trigram(trigram);
+        return entry ? std::min(Size(entry->count), file_count()) : 0;
+    }
+
+    // Returns the list of the files containing the trigram. The list runs up to where the
+    // next one starts, and is checked before it's used.
+    PostingList postings(UInt32 trigram) const {
+        const IndexTrigramEntry *entry = find_trigram(trigram);
+        if (!entry) {
+            return PostingList();
+        }
+        const IndexTrigramEntry *next = entry + 1;
+        UInt64 end = next < m_trigrams + trigram_count() ? next->offset : m_postings_length;
+        if (entry->offset > end || end > m_postings_length || entry->count > file_count() ||
+            !is_well_formed_posting_list(m_postings + entry->offset, entry->count, end - entry->offset)) {
+            m_is_damaged = true;
+            return PostingList();
+        }
+        return PostingList(m_postings + entry->offset, entry->count);
+    }
+
+    // Returns an upper bound on the number of files that could satisfy the query, from
+    // the lengths of the posting lists alone, without decoding any of them
+    Size estimate(const TrigramQuery &query) const {
+        switch (query.op()) {
+            case TrigramQuery::Op::All:
+                return file_count();
+            case TrigramQuery::Op::None:
+                return 0;
+            case TrigramQuery::Op::And: {
+                Size result = file_count();
+                for (UInt32 trigram : query.trigrams()) {
+                    result = std::min(result, posting_count(trigram));
+                }
+                for (const auto &subquery : query.subqueries()) {
+                    result = std::min(result, estimate(subquery));
+                }
+                return result;
+            }
+            case TrigramQuery::Op::Or: {
+                Size result = 0;
+                for (UInt32 trigram : query.trigrams()) {
+                    result += posting_count(trigram);
+                }
+                for (const auto &subquery : query.subqueries()) {
+                    result += estimate(subquery);
+                }
+                return std::min(result, file_count());
+            }
+        }
+        return file_count();
+    }
+
+    // Returns the files that could satisfy the query
+    FileIdSet evaluate(const TrigramQuery &query) const {
+        FileIdSet result;
+        switch (query.op()) {
+            case TrigramQuery::Op::All:
+                result.is_all = true;
+                return result;
+            case TrigramQuery::Op::None:
+                return result;
+            case TrigramQuery::Op::And: {
+                result.is_all = true;
+                auto intersect = [&result](std::vector<UInt32> &&ids) {
+                    if (result.is_all) {
+                        result.is_all = false;
+                        result.ids = std::move(ids);
+                        return;
+                    }
+                    std::vector<UInt32> both;
+                    std::set_intersection(result.ids.begin(), result.ids.end(), ids.begin(), ids.end(),
+                        std::back_inserter(both));
+                    result.ids = std::move(both);
+                };
+                // the trigram lists are intersected together without decoding them first
+                if (query.trigrams().size() > 0) {
+                    std::vector<PostingCursor> cursors;
+                    for (UInt32 trigram : query.trigrams()) {
+                        cursors.emplace_back(postings(trigram));
+                    }
+                    intersect(intersect_postings(cursors));
+                }
+                for (const auto &subquery : query.subqueries()) {
+                    FileIdSet sub = evaluate(subquery);
+                    if (!sub.is_all) {
+                        intersect(std::move(sub.ids));
+                    }
+                }
+                return result;
+            }
+            case TrigramQuery::Op::Or: {
+                auto unite = [&result](const std::vector<UInt32> &ids) {
+                    std::vector<UInt32> either;
+                    std::set_union(result.ids.begin(), result.ids.end(), ids.begin(), ids.end(),
+                        std::back_inserter(either));
+                    result.ids = std::move(either);
+                };
+                for (UInt32 trigram : query.trigrams()) {
+                    unite(postings(trigram).decode());
+                }
+                for (const auto &subquery : query.subqueries()) {
+                    FileIdSet sub = evaluate(subquery);
+                    if (sub.is_all) {
+                        return sub;
+                    }
+                    unite(sub.ids);
+                }
+                return result;
+            }
+        }
+        return result;
+    }
+
+private:
+    const IndexTrigramEntry *find_trigram(UInt32 trigram) const {
+        const IndexTrigramEntry *end = m_trigrams + trigram_count();
+        const IndexTrigramEntry *entry = std::lower_bound(m_trigrams, end, trigram,
+            [](const IndexTrigramEntry &e, UInt32 t) { return e.trigram < t; });
+        return entry == end || entry->trigram != trigram ? nullptr : entry;
+    }
+
+    std::unique_ptr<MappedFile> m_mapped_file;
+    const char *m_base = nullptr;
+    const IndexHeader *m_header = nullptr;
+    IndexedFiles m_files;
+    const IndexTrigramEntry *m_trigrams = nullptr;
+    const char *m_postings = nullptr;
+    Size m_postings_length = 0;
+    mutable bool m_is_damaged = false;
+};
+
+// The trigrams a file must have to match. All the needles must be in a file for it to match,
+// unless any one of them will do. Exclusions only remove lines, so they don't figure in.
+static TrigramQuery trigram_query_for_needles(const Env &env)
+{
+    bool any = env.match_type() == MatchType::Any;
+    TrigramQuery query(any ? TrigramQuery::Op::None : TrigramQuery::Op::All);
+    for (const auto &needle_query : env.plan().trigram_queries()) {
+        query = any ? query.or_with(needle_query) : query.and_with(needle_query);
+    }
+    return query;
+}
+
+// Decides which files a search can skip, using the index if there is one. A file is
+// skipped only if the index has its current version and its trigrams can't satisfy the
+// query. Files the index doesn't know about are always searched.
+class IndexFilter
+{
+public:
+    // When the query could match at least this share of the indexed files, checking each
+    // file against the index costs more than it saves, and every file is searched
+    static constexpr double FullScanFileShare = 0.9;
+
+    // A search expected to read more than this many bytes is reported before it starts
+    static constexpr UInt64 LargeSearchBytes = UInt64(1) << 30;
+
+    void prepare(const Env &env) {
+        if (!m_index.load(env.current_path() / IndexFilename)) {
+            return;
+        }
+        m_has_index = true;
+        m_query = trigram_query_for_needles(env);
+
+        // the needles that are in the fewest files are the best to look for first
+        for (const auto &needle_query : env.plan().trigram_queries()) {
+            m_needle_estimates.push_back(m_index.estimate(needle_query));
+        }
+        m_needle_order.resize(m_needle_estimates.size());
+        std::iota(m_needle_order.begin(), m_needle_order.end(), 0);
+        std::stable_sort(m_needle_order.begin(), m_needle_order.end(), [this](Size a, Size b) {
+            return m_needle_estimates[a] < m_needle_estimates[b];
+        });
+
+        m_estimate = m_index.estimate(m_query);
+        if (m_query.is_all() || m_estimate >= FullScanFileShare * m_index.file_count()) {
+            m_candidate_count = m_index.file_count();
+            for (UInt32 id = 0; id < m_index.file_count(); id++) {
+                m_candidate_bytes += m_index.files().entry(id).size;
+            }
+            return;
+        }
+        FileIdSet candidates = m_index.evaluate(m_query);
+        bool has_bad_id = std::any_of(candidates.ids.begin(), candidates.ids.end(),
+            [this](UInt32 id) { return id >= m_index.file_count(); });
+        if (m_index.is_damaged() || has_bad_id) {
+            // a damaged index is treated as missing, and every file is searched
+            m_has_index = false;
+            m_needle_estimates.clear();
+            m_needle_order.clear();
+            m_estimate = 0;
+            return;
+        }
+        m_candidates.assign(m_index.file_count(), false);
+        for (UInt32 id : candidates.ids) {
+            m_candidates[id] = true;
+            m_candidate_bytes += m_index.files().entry(id).size;
+        }
+        m_candidate_count = candidates.ids.size();
+        m_is_active = true;
+    }
+
+    bool has_index() const { return m_has_index; }
+    bool is_active() const { return m_is_active; }
+
+    // The needle numbers from the one in the fewest files to the one in the most, or empty with no index
+    const std::vector<Size> &needle_order() const { return m_needle_order; }
+
+    bool is_large_search() const { return m_candidate_bytes > LargeSearchBytes; }
+
+    bool should_search(const fs::path &filename, const Env &env) const {
+        if (!m_is_active) {
+            return true;
+        }
+        const IndexedFiles &files = m_index.files();
+        Size id = files.find(index_relative_path(filename, env.current_path()));
+        return id == String::npos || m_candidates[id] || !files.is_current(UInt32(id), filename);
+    }
+
+    String estimate_string() const {
+        String result;
+        result += "index: about ";
+        result += std::to_string(m_candidate_count);
+        result += " files and ";
+        result += std::to_string(m_candidate_bytes);
+        result += " bytes to search";
+        return result;
+    }
+
+    String to_string() const {
+        String result;
+        result += "index: ";
+        result += m_query.to_string();
+        result += "\nindex: needles in at most";
+        for (Size idx = 0; idx < m_needle_estimates.size(); idx++) {
+            result += idx == 0 ? " " : ", ";
+            result += std::to_string(m_needle_estimates[idx]);
+        }
+        result += " files, searched in the order";
+        for (Size needle_index : m_needle_order) {
+            result += " ";
+            result += std::to_string(needle_index + 1);
+        }
+        result += "\nindex: ";
+        if (m_is_active) {
+            result += std::to_string(m_candidate_count);
+            result += " of ";
+            result += std::to_string(m_index.file_count());
+            result += " indexed files are candidates";
+        }
+        else {
+            result += "unused, since the query could match ";
+            result += std::to_string(m_estimate);
+            result += " of ";
+            result += std::to_string(m_index.file_count());
+            result += " indexed files";
+        }
+        result += "\n";
+        result += estimate_string();
+        return result;
+    }
+
+private:
+    ContentIndex m_index;
+    TrigramQuery m_query;
+    std::vector<Size> m_needle_estimates;
+    std::vector<Size> m_needle_order;
+    std::vector<bool> m_candidates;
+    Size m_estimate = 0;
+    Size m_candidate_count = 0;
+    UInt64 m_candidate_bytes = 0;
+    bool m_has_index = false;
+    bool m_is_active = false;
+};
+
+IndexFilter g_index_filter;
+
+// Index builds split the files among workers, and each gathers the (trigram, file id) pairs
+// for the files it takes into a private shard. A shard that reaches IndexShardPairCount
+// pairs is sorted and written out as a run, and the runs are merged into the index, so the
+// memory a build needs depends on the number of workers rather than the size of the tree.
+static constexpr Size IndexShardPairCount = 1 << 22;
+
+// the most runs merged at once, and how many pairs are read from each at a time
+static constexpr Size IndexMergeFanIn = 64;
+static constexpr Size IndexRunBufferPairCount = 1 << 14;
+
+// Sets the file's entry and returns its distinct trigrams, which are left empty for
+// files that are always searched
+static void gather_file_trigrams(const fs::path &filename, IndexFileEntry &entry, std::vector<UInt32> &file_trigrams)
+{
+    file_trigrams.clear();
+    MappedFile mapped_file(filename);
+    if (mapped_file.is_valid<false>() || !file_fingerprint(filename, entry.size, entry.modified)) {
+        entry.flags |= IndexFileAlwaysSearch;
+        return;
+    }
+    StringView source((char *)mapped_file.base(), mapped_file.file_length());
+    Size bom_length = 0;
+    if (sniff_encoding(source, bom_length) != Encoding::UTF8) {
+        entry.flags |= IndexFileAlwaysSearch;
+        return;
+    }
+    for (Size idx = 0; idx + 3 <= source.length(); idx++) {
+        file_trigrams.push_back(trigram_at(source.data() + idx));
+    }
+    std::sort(file_trigrams.begin(), file_trigrams.end());
+    file_trigrams.erase(std::unique(file_trigrams.begin(), file_trigrams.end()), file_trigrams.end());
+}
+
+static Size index_worker_count()
+{
+    return std::max(1, UU::get_good_concurrency_count());
+}
+
+// Calls work with each worker number, all at once, and waits for them all to finish
+template <typename Work>
+static void run_index_workers(Size worker_count, Work work)
+{
+#if USE_DISPATCH
+    dispatch_group_t group = dispatch_group_create();
+    dispatch_queue_t queue = dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_HIGH, 0);
+    for (Size worker = 0; worker < worker_count; worker++) {
+        dispatch_group_async(group, queue, ^{
+            work(worker);
+        });
+    }
+    dispatch_group_wait(group, DISPATCH_TIME_FOREVER);
+#else
+    std::vector<std::future<void>> futures;
+    for (Size worker = 0; worker < worker_count; worker++) {
+        futures.push_back(std::async(std::launch::async, work, worker));
+    }
+    for (auto &f : futures) {
+        f.wait();
+    }
+#endif
+}
+
+static bool write_index_run(const fs::path &path, std::vector<UInt64> &pairs)
+{
+    std::sort(pairs.begin(), pairs.end());
+    std::ofstream file(path, std::ios::binary);
+    file.write((const char *)pairs.data(), pairs.size() * sizeof(UInt64));
+    pairs.clear();
+    return !file.fail();
+}
+
+// Reads the pairs of a run in order, a buffer at a time
+class IndexRunReader
+{
+public:
+    IndexRunReader(const fs::path &path) : m_file(path, std::ios::binary) { fill(); }
+
+    bool is_at_end() const { return m_position >= m_pairs.size(); }
+    UInt64 value() const { return m_pairs[m_position]; }
+
+    void next() {
+        if (++m_position >= m_pairs.size()) {
+            fill();
+        }
+    }
+
+private:
+    void fill() {
+        m_pairs.resize(IndexRunBufferPairCount);
+        m_file.read((char *)m_pairs.data(), m_pairs.size() * sizeof(UInt64));
+        m_pairs.resize(m_file.gcount() / sizeof(UInt64));
+        m_position = 0;
+    }
+
+    std::ifstream m_file;
+    std::vector<UInt64> m_pairs;
+    Size m_position = 0;
+};
+
+// Visits the pairs of the runs in order
+template <typename Visitor>
+static void merge_index_runs(const std::vector<fs::path> &runs, Visitor visit)
+{
+    using Head = std::pair<UInt64, Size>;
+    std::vector<std::unique_ptr<IndexRunReader>> readers;
+    std::priority_queue<Head, std::vector<Head>, std::greater<Head>> heads;
+    for (const auto &run : runs) {
+        auto &reader = readers.emplace_back(std::make_unique<IndexRunReader>(run));
+        if (!reader->is_at_end()) {
+            heads.emplace(reader->value(), readers.size() - 1);
+        }
+    }
+    while (!heads.empty()) {
+        auto [pair, idx] = heads.top();
+        heads.pop();
+        visit(pair);
+        IndexRunReader &reader = *readers[idx];
+        reader.next();
+        if (!reader.is_at_end()) {
+            heads.emplace(reader.value(), idx);
+        }
+    }
+}
+
+// Merges runs in groups of IndexMergeFanIn until no more than that many are left, which
+// keeps both the open files and the read buffers bounded
+static bool reduce_index_runs(std::vector<fs::path> &runs, const fs::path &run_directory)
+{
+    Size merged_count = 0;
+    while (runs.size() > IndexMergeFanIn) {
+        std::vector<fs::path> merged_runs;
+        for (Size first = 0; first < runs.size(); first += IndexMergeFanIn) {
+            std::vector<fs::path> group(runs.begin() + first, runs.begin() + std::min(first + IndexMergeFanIn, runs.size()));
+            const fs::path path = run_directory / ("merged-" + std::to_string(merged_count++));
+            std::ofstream file(path, std::ios::binary);
+            std::vector<UInt64> pairs;
+            merge_index_runs(group, [&](UInt64 pair) {
+                pairs.push_back(pair);
+                if (pairs.size() == IndexRunBufferPairCount) {
+                    file.write((const char *)pairs.data(), pairs.size() * sizeof(UInt64));
+                    pairs.clear();
+                }
+            });
+            file.write((const char *)pairs.data(), pairs.size() * sizeof(UInt64));
+            if (file.fail()) {
+                return false;
+            }
+            for (const auto &run : group) {
+                fs::remove(run);
+            }
+            merged_runs.push_back(path);
+        }
+        runs = std::move(merged_runs);
+    }
+    return true;
+}
+
+// Lays out the paths one after another, each ending in a NUL, and points each file's entry
+// at its own. Returns false if there are more files or path bytes than the 32-bit ids and
+// offsets of the index files can hold.
+static bool lay_out_index_paths(const std::vector<std::string> &paths, std::vector<IndexFileEntry> &files,
+    std::string &path_bytes)
+{
+    if (paths.size() > UINT32_MAX) {
+        return false;
+    }
+    for (Size id = 0; id < paths.size(); id++) {
+        if (path_bytes.length() > UINT32_MAX) {
+            return false;
+        }
+        files[id].path_offset = UInt32(path_bytes.length());
+        path_bytes += paths[id];
+        path_bytes += '\0';
+    }
+    return true;
+}
+
+static int build_index_with_runs(const Env &env, const std::vector<std::string> &paths, const fs::path &run_directory)
+{
+    const fs::path index_path = env.current_path() / IndexFilename;
+
+    // ids follow path order, so each file's entry and path offset are known up front
+    std::vector<IndexFileEntry> files(paths.size());
+    std::string path_bytes;
+    if (!lay_out_index_paths(paths, files, path_bytes)) {
+        std::cerr << "*** search: too many files to index: " << env.current_path() << std::endl;
+        return -1;
+    }
+
+    const Size worker_count = index_worker_count();
+    std::atomic<Size> next_id = 0;
+    std::atomic<bool> run_failed = false;
+    std::mutex runs_lock;
+    std::vector<fs::path> runs;
+
+    // each worker takes the next file until there are none left, so a few large files don't hold up the rest
+    auto index_files = [&](Size worker) {
+        std::vector<UInt64> shard;
+        std::vector<UInt32> file_trigrams;
+        Size run_count = 0;
+        auto flush = [&] {
+            const fs::path path = run_directory / (std::to_string(worker) + "-" + std::to_string(run_count++));
+            if (!write_index_run(path, shard)) {
+                run_failed = true;
+            }
+            std::lock_guard guard(runs_lock);
+            runs.push_back(path);
+        };
+        for (Size id = next_id++; id < paths.size(); id = next_id++) {
+            gather_file_trigrams(env.current_path() / paths[id], files[id], file_trigrams);
+            for (UInt32 trigram : file_trigrams) {
+                shard.push_back((UInt64(trigram) << 32) | id);
+            }
+            if (shard.size() >= IndexShardPairCount) {
+                flush();
+            }
+        }
+        if (!shard.empty()) {
+            flush();
+        }
+    };
+
+    run_index_workers(worker_count, index_files);
+
+    const Size run_count = runs.size();
+    if (run_failed || !reduce_index_runs(runs, run_directory)) {
+        std::cerr << "*** search: unable to write index runs: " << run_directory << std::endl;
+        return -1;
+    }
+
+    // the merge yields each trigram's file ids in order, and its list is encoded as soon as it ends
+    std::vector<IndexTrigramEntry> trigrams;
+    const fs::path postings_path = run_directory / "postings";
+    std::ofstream postings_file(postings_path, std::ios::binary);
+    UInt64 postings_length = 0;
+    UInt64 pair_count = 0;
+    std::vector<UInt32> ids;
+    std::string encoded;
+    auto finish_list = [&] {
+        encoded.clear();
+        encode_postings(ids.data(), ids.size(), encoded);
+        // a file adds each of its trigrams once, so no list is longer than the 32-bit file count
+        trigrams.back().count = UInt32(ids.size());
+        postings_file.write(encoded.data(), encoded.length());
+        postings_length += encoded.length();
+        ids.clear();
+    };
+    merge_index_runs(runs, [&](UInt64 pair) {
+        UInt32 trigram = UInt32(pair >> 32);
+        if (trigrams.empty() || trigrams.back().trigram != trigram) {
+            if (!trigrams.empty()) {
+                finish_list();
+            }
+            trigrams.push_back({ trigram, 0, postings_length });
+        }
+        ids.push_back(UInt32(pair));
+        pair_count++;
+    });
+    if (!trigrams.empty()) {
+        finish_list();
+    }
+    const std::string padding(PostingPaddingLength, '\0');
+    postings_file.write(padding.data(), padding.length());
+    postings_length += padding.length();
+    postings_file.close();
+    if (postings_file.fail()) {
+        std::cerr << "*** search: unable to write index runs: " << run_directory << std::endl;
+        return -1;
+    }
+
+    IndexHeader header;
+    memcpy(header.magic, IndexMagic, sizeof(IndexMagic));
+    header.file_count = UInt32(files.size());
+    // trigrams are three bytes, so there are never more than 2^24 of them
+    header.trigram_count = UInt32(trigrams.size());
+    header.postings_offset = sizeof(IndexHeader) + files.size() * sizeof(IndexFileEntry) +
+        trigrams.size() * sizeof(IndexTrigramEntry);
+    header.paths_offset = header.postings_offset + postings_length;
+
+    bool written = write_index_file(index_path, [&](std::ofstream &file) {
+        file.write((const char *)&header, sizeof(header));
+        file.write((const char *)files.data(), files.size() * sizeof(IndexFileEntry));
+        file.write((const char *)trigrams.data(), trigrams.size() * sizeof(IndexTrigramEntry));
+        std::ifstream postings_input(postings_path, std::ios::binary);
+        file << postings_input.rdbuf();
+        file.write(path_bytes.data(), path_bytes.length());
+    });
+    if (!written) {
+        std::cerr << "*** search: unable to write index: " << index_path << std::endl;
+        return -1;
+    }
+
+    std::cout << "indexed " << files.size() << " files: " << trigrams.size() << " trigrams, " <<
+        pair_count << " postings in " << postings_length << " bytes, merged from " << run_count << " runs" <<
+        " by " << worker_count << " workers" << std::endl;
+    return 0;
+}
+
+// The relative paths of the files the walk finds, in order, which are the files the same
+// options would search
+static std::vector<std::string> walk_index_paths(const Env &env)
+{
+    std::vector<std::string> paths;
+    walk_files(env, env.current_path(), [&](const fs::path &filename) {
+        StringView relative_path = index_relative_path(filename, env.current_path());
+        if (relative_path.length() > 0 && !is_index_file(filename)) {
+            paths.emplace_back(relative_path);
+        }
+        return true;
+    });
+    std::sort(paths.begin(), paths.end());
+    return paths;
+}
+
+// Builds the index for every file the walk finds
+static int build_index(const Env &env)
+{
+    std::vector<std::string> paths = walk_index_paths(env);
+
+    // the runs go in a new directory with a name no one else can guess or claim first,
+    // which only this user can get into, and which is removed however the build ends
+    std::error_code error;
+    std::string run_template = (fs::temp_directory_path(error) / "search-index-XXXXXX").string();
+    if (error || mkdtemp(run_template.data()) == nullptr) {
+        std::cerr << "*** search: unable to create directory for index runs: " << run_template << std::endl;
+        return -1;
+    }
+    struct RunDirectory
+    {
+        fs::path path;
+        ~RunDirectory() {
+            std::error_code error;
+            fs::remove_all(path, error);
+        }
+    };
+    const RunDirectory run_directory = { run_template };
+    return build_index_with_runs(env, paths, run_directory.path);
+}
+
+// The filters file has, in order: a header, the table of files sorted by relative path, the
+// location of each file's filter, the filters, and the file paths. A search checks a file's
+// filter against the query before opening the file. Each filter has FilterBitsPerTrigram bits
+// for each of its file's distinct trigrams, but never more than FilterMaxWordCount words, so
+// the filters cost at most that much for each file however large the files are, and are
+// well under the size of the index. A filter uses the number of hashes that suits the bits
+// it has for each trigram, up to FilterMaxHashCount. At full size, about one trigram in 45
+// that isn't in a file gets through its filter. A capped filter lets more through, though a
+// file is only opened if all of a needle's trigrams get through.
+static constexpr char FiltersMagic[8] = { 'S', 'R', 'C', 'H', 'B', 'L', 'M', '2' };
+static constexpr Size FilterBitsPerTrigram = 8;
+static constexpr Size FilterMaxHashCount = 6;
+static constexpr Size FilterMaxWordCount = 128;
+
+struct FiltersHeader
+{
+    char magic[8];
+    UInt32 file_count;
+    UInt32 hash_count;
+    UInt64 filters_offset;
+    UInt64 paths_offset;
+};
+
+// where a file's filter starts after filters_offset, and its length, both in 64-bit words,
+// the number of hashes it uses, and a checksum of its words, since a damaged word could
+// otherwise rule out a file that matches
+struct FilterEntry
+{
+    UInt64 offset;
+    UInt32 word_count;
+    UInt32 hash_count;
+    UInt64 checksum;
+};
+
+// FNV-1a over a filter, a word at a time
+static UInt64 filter_checksum(const UInt64 *words, Size word_count)
+{
+    UInt64 checksum = 0xcbf29ce484222325ULL;
+    for (Size idx = 0; idx < word_count; idx++) {
+        checksum = (checksum ^ words[idx]) * 0x100000001b3ULL;
+    }
+    return checksum;
+}
+
+static UInt64 filter_hash(UInt32 trigram)
+{
+    UInt64 hash = trigram + 0x9E3779B97F4A7C15ULL;
+    hash = (hash ^ (hash >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    hash = (hash ^ (hash >> 27)) * 0x94D049BB133111EBULL;
+    return hash ^ (hash >> 31);
+}
+
+// The bit a probe of a trigram's hash lands on, derived from the two halves of the hash
+static Size filter_bit(UInt64 hash, Size probe, Size bit_count)
+{
+    UInt32 value = UInt32(hash) + UInt32(probe) * (UInt32(hash >> 32) | 1);
+    return (UInt64(value) * bit_count) >> 32;
+}
+
+static Size filter_word_count(Size trigram_count)
+{
+    return std::clamp((trigram_count * FilterBitsPerTrigram + 63) / 64, Size(1), FilterMaxWordCount);
+}
+
+// The number of hashes that lets the fewest absent trigrams through a filter of this size,
+// which is ln 2 times the bits for each trigram
+static Size filter_hash_count(Size trigram_count, Size word_count)
+{
+    if (trigram_count == 0) {
+        return FilterMaxHashCount;
+    }
+    Size hash_count = (word_count * 64 * 693 + trigram_count * 500) / (trigram_count * 1000);
+    return std::clamp(hash_count, Size(1), FilterMaxHashCount);
+}
+
+class FileFilter
+{
+public:
+    FileFilter(const UInt64 *words, Size word_count, Size hash_count) :
+        m_words(words), m_bit_count(word_count * 64), m_hash_count(hash_count) {}
+
+    bool might_contain(UInt32 trigram) const {
+        UInt64 hash = filter_hash(trigram);
+        for (Size probe = 0; probe < m_hash_count; probe++) {
+            Size bit = filter_bit(hash, probe, m_bit_count);
+            if ((m_words[bit / 64] & (UInt64(1) << (bit % 64))) == 0) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Returns false only if the file can't have the trigrams the query needs
+    bool might_match(const TrigramQuery &query) const {
+        switch (query.op()) {
+            case TrigramQuery::Op::All:
+                return true;
+            case TrigramQuery::Op::None:
+                return false;
+            case TrigramQuery::Op::And:
+                for (UInt32 trigram : query.trigrams()) {
+                    if (!might_contain(trigram)) {
+                        return false;
+                    }
+                }
+                for (const auto &subquery : query.subqueries()) {
+                    if (!might_match(subquery)) {
+                        return false;
+                    }
+                }
+                return true;
+            case TrigramQuery::Op::Or:
+                for (UInt32 trigram : query.trigrams()) {
+                    if (might_contain(trigram)) {
+                        return true;
+                    }
+                }
+                for (const auto &subquery : query.subqueries()) {
+                    if (might_match(subquery)) {
+                        return true;
+                    }
+                }
+                return false;
+        }
+        return true;
+    }
+
+private:
+    const UInt64 *m_words;
+    Size m_bit_count;
+    Size m_hash_count;
+};
+
+// Decides which files a search can skip using the filters, if there are any. Like the index,
+// a filter only rules out the version of the file it was built from. Keeps count of what the
+// filters skip, and of the files they let through that turn out not to match, which is the
+// measure of how well they're working.
+class FileFilters
+{
+public:
+    void prepare(const Env &env) {
+        m_mapped_file = std::make_unique<MappedFile>(env.current_path() / FiltersFilename);
+        if (m_mapped_file->is_valid<false>() || m_mapped_file->file_length() < sizeof(FiltersHeader)) {
+            return;
+        }
+        const char *base = (const char *)m_mapped_file->base();
+        m_header = (const FiltersHeader *)base;
+        if (memcmp(m_header->magic, FiltersMagic, sizeof(FiltersMagic)) != 0) {
+            return;
+        }
+        const UInt64 length = m_mapped_file->file_length();
+        const UInt64 entries_offset = sizeof(FiltersHeader) + UInt64(m_header->file_count) * sizeof(IndexFileEntry);
+        if (!fits_within(sizeof(FiltersHeader), m_header->file_count, sizeof(IndexFileEntry), length) ||
+            !fits_within(entries_offset, m_header->file_count, sizeof(FilterEntry), m_header->filters_offset) ||
+            m_header->filters_offset % sizeof(UInt64) != 0 || m_header->filters_offset > m_header->paths_offset ||
+            m_header->paths_offset > length || m_header->hash_count > 64) {
+            return;
+        }
+        const IndexFileEntry *files = (const IndexFileEntry *)(base + sizeof(FiltersHeader));
+        m_files = IndexedFiles(files, m_header->file_count, base + m_header->paths_offset,
+            length - m_header->paths_offset);
+        m_entries = (const FilterEntry *)(base + entries_offset);
+        m_words = (const UInt64 *)(base + m_header->filters_offset);
+        const UInt64 word_count = (m_header->paths_offset - m_header->filters_offset) / sizeof(UInt64);
+        if (!m_files.is_well_formed()) {
+            return;
+        }
+        // the filters are written one after another, so each must start where the last one ends
+        UInt64 next_offset = 0;
+        for (Size id = 0; id < m_files.count(); id++) {
+            const FilterEntry &entry = m_entries[id];
+            if (entry.offset != next_offset || !fits_within(next_offset, entry.word_count, 1, word_count) ||
+                (entry.word_count > 0 && (entry.hash_count == 0 || entry.hash_count > m_header->hash_count))) {
+                return;
+            }
+            next_offset += m_entries[id].word_count;
+        }
+        if (next_offset != word_count) {
+            return;
+        }
+        m_query = trigram_query_for_needles(env);
+        m_is_active = !m_query.is_all();
+    }
+
+    bool is_active() const { return m_is_active; }
+
+    // Sets checked when the file was checked against its filter and got through
+    bool should_search(const fs::path &filename, const Env &env, bool &checked) {
+        checked = false;
+        if (!m_is_active) {
+            return true;
+        }
+        Size id = m_files.find(index_relative_path(filename, env.current_path()));
+        if (id == String::npos || !m_files.is_current(UInt32(id), filename)) {
+            return true;
+        }
+        const FilterEntry &entry = m_entries[id];
+        if (entry.word_count == 0 || filter_checksum(m_words + entry.offset, entry.word_count) != entry.checksum) {
+            return true;
+        }
+        FileFilter filter(m_words + entry.offset, entry.word_count, entry.hash_count);
+        if (!filter.might_match(m_query)) {
+            m_skipped_files++;
+            m_skipped_bytes += m_files.entry(UInt32(id)).size;
+            return false;
+        }
+        checked = true;
+        return true;
+    }
+
+    void add_checked_file(bool has_match) {
+        m_checked_files++;
+        if (!has_match) {
+            m_false_positives++;
+        }
+    }
+
+    String to_string() const {
+        Size skipped_files = m_skipped_files.load();
+        Size false_positives = m_false_positives.load();
+        Size negatives = skipped_files + false_positives;
+        String result;
+        result += "filters: ";
+        result += m_query.to_string();
+        result += "\nfilters: ";
+        result += std::to_string(skipped_files);
+        result += " files skipped, ";
+        result += std::to_string(m_skipped_bytes.load());
+        result += " bytes unread, ";
+        result += std::to_string(m_checked_files.load());
+        result += " let through, ";
+        result += std::to_string(false_positives);
+        result += " of them without a match\nfilters: ";
+        char rate[32];
+        snprintf(rate, sizeof(rate), "%.1f%%", negatives == 0 ? 0.0 : 100.0 * false_positives / negatives);
+        result += rate;
+        result += " false positive rate";
+        return result;
+    }
+
+private:
+    std::unique_ptr<MappedFile> m_mapped_file;
+    const FiltersHeader *m_header = nullptr;
+    IndexedFiles m_files;
+    const FilterEntry *m_entries = nullptr;
+    const UInt64 *m_words = nullptr;
+    TrigramQuery m_query;
+    bool m_is_active = false;
+    std::atomic<Size> m_skipped_files = 0;
+    std::atomic<Size> m_skipped_bytes = 0;
+    std::atomic<Size> m_checked_files = 0;
+    std::atomic<Size> m_false_positives = 0;
+};
+
+FileFilters g_file_filters;
+
+// Builds a filter for every file the walk finds. Filters are independent of each other, so
+// each worker builds filters for the files it takes and they're written out in order at the end.
+static int build_filters(const Env &env)
+{
+    const fs::path filters_path = env.current_path() / FiltersFilename;
+    std::vector<std::string> paths = walk_index_paths(env);
+
+    std::vector<IndexFileEntry> files(paths.size());
+    std::string path_bytes;
+    if (!lay_out_index_paths(paths, files, path_bytes)) {
+        std::cerr << "*** search: too many files to filter: " << env.current_path() << std::endl;
+        return -1;
+    }
+
+    std::vector<std::vector<UInt64>> filters(paths.size());
+    std::vector<UInt32> hash_counts(paths.size(), 0);
+    std::atomic<Size> next_id = 0;
+    std::atomic<Size> trigram_count = 0;
+    std::atomic<Size> capped_count = 0;
+    const Size worker_count = index_worker_count();
+    run_index_workers(worker_count, [&](Size worker) {
+        std::vector<UInt32> file_trigrams;
+        for (Size id = next_id++; id < paths.size(); id = next_id++) {
+            gather_file_trigrams(env.current_path() / paths[id], files[id], file_trigrams);
+            if (files[id].flags & IndexFileAlwaysSearch) {
+                continue;
+            }
+            std::vector<UInt64> &words = filters[id];
+            words.assign(filter_word_count(file_trigrams.size()), 0);
+            const Size bit_count = words.size() * 64;
+            const Size hash_count = filter_hash_count(file_trigrams.size(), words.size());
+            hash_counts[id] = UInt32(hash_count);
+            if (bit_count < file_trigrams.size() * FilterBitsPerTrigram) {
+                capped_count++;
+            }
+            for (UInt32 trigram : file_trigrams) {
+                UInt64 hash = filter_hash(trigram);
+                for (Size probe = 0; probe < hash_count; probe++) {
+                    Size bit = filter_bit(hash, probe, bit_count);
+                    words[bit / 64] |= UInt64(1) << (bit % 64);
+                }
+            }
+            trigram_count += file_trigrams.size();
+        }
+    });
+
+    std::vector<FilterEntry> entries;
+    UInt64 word_count = 0;
+    for (Size id = 0; id < filters.size(); id++) {
+        // filter_word_count keeps every filter to FilterMaxWordCount words
+        entries.push_back({ word_count, UInt32(filters[id].size()), hash_counts[id],
+            filter_checksum(filters[id].data(), filters[id].size()) });
+        word_count += filters[id].size();
+    }
+
+    FiltersHeader header;
+    memcpy(header.magic, FiltersMagic, sizeof(FiltersMagic));
+    header.file_count = UInt32(files.size());
+    header.hash_count = FilterMaxHashCount;
+    header.filters_offset = sizeof(FiltersHeader) + files.size() * sizeof(IndexFileEntry) +
+        entries.size() * sizeof(FilterEntry);
+    header.paths_offset = header.filters_offset + word_count * sizeof(UInt64);
+
+    bool written = write_index_file(filters_path, [&](std::ofstream &file) {
+        file.write((const char *)&header, sizeof(header));
+        file.write((const char *)files.data(), files.size() * sizeof(IndexFileEntry));
+        file.write((const char *)entries.data(), entries.size() * sizeof(FilterEntry));
+        for (const auto &words : filters) {
+            file.write((const char *)words.data(), words.size() * sizeof(UInt64));
+        }
+        file.write(path_bytes.data(), path_bytes.length());
+    });
+    if (!written) {
+        std::cerr << "*** search: unable to write filters: " << filters_path << std::endl;
+        return -1;
+    }
+
+    std::cout << "filtered " << files.size() << " files: " << trigram_count.load() << " trigrams in " <<
+        word_count * sizeof(UInt64) << " bytes of filters, " << capped_count.load() << " of them capped" << std::endl;
+
+    // the filters are meant to be the lighter option, so their size is shown beside the index's
+    std::error_code error;
+    std::cout << "filters: " << fs::file_size(filters_path, error) << " bytes on disk";
+    UInt64 index_size = fs::file_size(env.current_path() / IndexFilename, error);
+    if (!error) {
+        std::cout << ", index: " << index_size << " bytes on disk";
+    }
+    std::cout << std::endl;
+    return 0;
+}
+
+// Cached line tables, written by --line-tables alongside an index or filters to .search-lines,
+// save a search from scanning every line before a match to number it. The layout, in order: a
+// header, the table of files sorted by relative path, the location of each file's table, the
+// tables, and the file paths. A table holds the start of every LineSampleInterval-th line,
+// after any byte order mark, each as a varint of its distance from the one before.
+static constexpr char LinesMagic[8] = { 'S', 'R', 'C', 'H', 'L', 'I', 'N', '2' };
+
+struct LinesHeader
+{
+    char magic[8];
+    UInt32 file_count;
+    UInt32 sample_interval;
+    UInt64 tables_offset;
+    UInt64 paths_offset;
+};
+
+// where a file's table starts after tables_offset, how many samples it has, and a
+// checksum of its bytes, since a damaged delta can still land on some other line start
+struct LineTableEntry
+{
+    UInt64 offset;
+    UInt64 sample_count;
+    UInt64 checksum;
+};
+
+// FNV-1a over a line table
+static UInt64 line_table_checksum(const unsigned char *data, Size length)
+{
+    UInt64 checksum = 0xcbf29ce484222325ULL;
+    for (Size idx = 0; idx < length; idx++) {
+        checksum = (checksum ^ data[idx]) * 0x100000001b3ULL;
+    }
+    return checksum;
+}
+
+static void append_varint(std::string &output, UInt64 value)
+{
+    while (value >= 0x80) {
+        output += char((value & 0x7F) | 0x80);
+        value >>= 7;
+    }
+    output += char(value);
+}
+
+// Returns the input after the varint, or nullptr if it doesn't end before end or overflows
+static const unsigned char *read_varint(const unsigned char *input, const unsigned char *end, UInt64 &value)
+{
+    value = 0;
+    for (Size shift = 0; input < end && shift < 64; shift += 7) {
+        unsigned char byte = *input++;
+        value |= UInt64(byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0) {
+            return input;
+        }
+    }
+    return nullptr;
+}
+
+// Returns the sampled line starts of a UTF-8 file, without its byte order mark
+static std::string encode_line_samples(StringView source)
+{
+    std::string output;
+    Size previous = 0;
+    Size line = 0;
+    append_varint(output, 0);
+    const char *ptr = source.data();
+    const char *end = source.data() + source.length();
+    while ((ptr = (const char *)memchr(ptr, '\n', end - ptr)) != nullptr) {
+        ptr++;
+        line++;
+        if (line % LineSampleInterval == 0) {
+            Size start = ptr - source.data();
+            append_varint(output, start - previous);
+            previous = start;
+        }
+    }
+    return output;
+}
+
+class LineTables
+{
+public:
+    void prepare(const Env &env) {
+        m_mapped_file = std::make_unique<MappedFile>(env.current_path() / LinesFilename);
+        if (m_mapped_file->is_valid<false>() || m_mapped_file->file_length() < sizeof(LinesHeader)) {
+            return;
+        }
+        const char *base = (const char *)m_mapped_file->base();
+        const LinesHeader *header = (const LinesHeader *)base;
+        if (memcmp(header->magic, LinesMagic, sizeof(LinesMagic)) != 0 || header->sample_interval != LineSampleInterval) {
+            return;
+        }
+        const UInt64 length = m_mapped_file->file_length();
+        const UInt64 entries_offset = sizeof(LinesHeader) + UInt64(header->file_count) * sizeof(IndexFileEntry);
+        if (!fits_within(sizeof(LinesHeader), header->file_count, sizeof(IndexFileEntry), length) ||
+            !fits_within(entries_offset, header->file_count, sizeof(LineTableEntry), header->tables_offset) ||
+            header->tables_offset > header->paths_offset || header->paths_offset > length) {
+            return;
+        }
+        const IndexFileEntry *files = (const IndexFileEntry *)(base + sizeof(LinesHeader));
+        m_files = IndexedFiles(files, header->file_count, base + header->paths_offset, length - header->paths_offset);
+        m_entries = (const LineTableEntry *)(base + entries_offset);
+        m_tables = (const unsigned char *)base + header->tables_offset;
+        m_tables_length = header->paths_offset - header->tables_offset;
+        if (!m_files.is_well_formed()) {
+            return;
+        }
+        // the tables are written one after another, and each sample takes at least a byte
+        UInt64 next_offset = 0;
+        for (Size id = 0; id < m_files.count(); id++) {
+            const LineTableEntry &entry = m_entries[id];
+            if (entry.offset != next_offset || entry.offset > m_tables_length) {
+                return;
+            }
+            next_offset = id + 1 < m_files.count() ? m_entries[id + 1].offset : m_tables_length;
+            if (next_offset < entry.offset || next_offset > m_tables_length ||
+                entry.sample_count > next_offset - entry.offset) {
+                return;
+            }
+        }
+        m_is_active = true;
+    }
+
+    // Fills in the sampled line starts if there's a table for the current version of the file.
+    // Each sample must be the start of a line in the text, or the table isn't used.
+    bool find(const fs::path &filename, const Env &env, StringView text, std::vector<Size> &line_samples) const {
+        if (!m_is_active) {
+            return false;
+        }
+        Size id = m_files.find(index_relative_path(filename, env.current_path()));
+        if (id == String::npos || !m_files.is_current(UInt32(id), filename)) {
+            return false;
+        }
+        const LineTableEntry &entry = m_entries[id];
+        const unsigned char *input = m_tables + entry.offset;
+        const unsigned char *end = m_tables + (id + 1 < m_files.count() ? m_entries[id + 1].offset : m_tables_length);
+        if (line_table_checksum(input, end - input) != entry.checksum) {
+            return false;
+        }
+        line_samples.resize(entry.sample_count);
+        Size start = 0;
+        for (Size idx = 0; idx < entry.sample_count; idx++) {
+            UInt64 delta = 0;
+            input = read_varint(input, end, delta);
+            if (!input || (idx == 0) != (delta == 0) || delta > text.length() - start ||
+                (start + delta > 0 && text[start + delta - 1] != '\n')) {
+                line_samples.clear();
+                return false;
+            }
+            start += delta;
+            line_samples[idx] = start;
+        }
+        return true;
+    }
+
+private:
+    std::unique_ptr<MappedFile> m_mapped_file;
+    IndexedFiles m_files;
+    const LineTableEntry *m_entries = nullptr;
+    const unsigned char *m_tables = nullptr;
+    UInt64 m_tables_length = 0;
+    bool m_is_active = false;
+};
+
+LineTables g_line_tables;
+
+// Builds a line table for every UTF-8 file the walk finds
+static int build_line_tables(const Env &env)
+{
+    const fs::path lines_path = env.current_path() / LinesFilename;
+    std::vector<std::string> paths = walk_index_paths(env);
+
+    std::vector<IndexFileEntry> files(paths.size());
+    std::string path_bytes;
+    if (!lay_out_index_paths(paths, files, path_bytes)) {
+        std::cerr << "*** search: too many files for line tables: " << env.current_path() << std::endl;
+        return -1;
+    }
+
+    std::vector<std::string> tables(paths.size());
+    std::atomic<Size> next_id = 0;
+    run_index_workers(index_worker_count(), [&](Size worker) {
+        for (Size id = next_id++; id < paths.size(); id = next_id++) {
+            const fs::path filename = env.current_path() / paths[id];
+            IndexFileEntry &entry = files[id];
+            MappedFile mapped_file(filename);
+            if (mapped_file.is_valid<false>() || !file_fingerprint(filename, entry.size, entry.modified)) {
+                entry.flags |= IndexFileAlwaysSearch;
+                continue;
+            }
+            StringView source((char *)mapped_file.base(), mapped_file.file_length());
+            Size bom_length = 0;
+            if (sniff_encoding(source, bom_length) != Encoding::UTF8) {
+                entry.flags |= IndexFileAlwaysSearch;
+                continue;
+            }
+            tables[id] = encode_line_samples(source.substr(bom_length));
+        }
+    });
+
+    std::vector<LineTableEntry> entries;
+    UInt64 tables_length = 0;
+    UInt64 sample_count = 0;
+    for (const auto &table : tables) {
+        // each varint ends with the first byte without its high bit set
+        Size count = 0;
+        for (unsigned char byte : table) {
+            count += (byte & 0x80) == 0;
+        }
+        entries.push_back({ tables_length, count, line_table_checksum((const unsigned char *)table.data(), table.length()) });
+        tables_length += table.length();
+        sample_count += count;
+    }
+
+    LinesHeader header;
+    memcpy(header.magic, LinesMagic, sizeof(LinesMagic));
+    header.file_count = UInt32(files.size());
+    header.sample_interval = LineSampleInterval;
+    header.tables_offset = sizeof(LinesHeader) + files.size() * sizeof(IndexFileEntry) +
+        entries.size() * sizeof(LineTableEntry);
+    header.paths_offset = header.tables_offset + tables_length;
+
+    bool written = write_index_file(lines_path, [&](std::ofstream &file) {
+        file.write((const char *)&header, sizeof(header));
+        file.write((const char *)files.data(), files.size() * sizeof(IndexFileEntry));
+        file.write((const char *)entries.data(), entries.size() * sizeof(LineTableEntry));
+        for (const auto &table : tables) {
+            file.write(table.data(), table.length());
+        }
+        file.write(path_bytes.data(), path_bytes.length());
+    });
+    if (!written) {
+        std::cerr << "*** search: unable to write line tables: " << lines_path << std::endl;
+        return -1;
+    }
+
+    std::cout << "sampled " << sample_count << " lines of " << files.size() << " files in " <<
+        tables_length << " bytes of line tables" << std::endl;
+    return 0;
+}
+
+// A definitions index, written by search --build-defs to .search-defs and read by search --def,
+// lists where the names in a tree are defined, found with a few rules for each language on a
+// line at a time. The layout, in order: a header, the table of files sorted by relative path,
+// the definitions sorted by name, then by file and line, the names, and the file paths. Files
+// are fingerprinted like the index, and a rebuild only reads the files that have changed.
+static constexpr char DefsMagic[8] = { 'S', 'R', 'C', 'H', 'D', 'E', 'F', '1' };
+
+struct DefsHeader
+{
+    char magic[8];
+    UInt32 file_count;
+    UInt32 def_count;
+    UInt64 defs_offset;
+    UInt64 names_offset;
+    UInt64 paths_offset;
+};
+
+struct DefEntry
+{
+    UInt32 name_offset;
+    UInt32 name_length;
+    UInt32 file_id;
+    UInt32 line;
+    UInt32 column;
+    UInt32 line_start;
+};
+
+struct Definition
+{
+    std::string name;
+    UInt32 line;
+    UInt32 column;
+    UInt32 line_start;
+};
+
+enum class DefLanguage { None, C, Python, Go, JavaScript };
+
+static DefLanguage def_language(const fs::path &filename)
+{
+    static const std::map<std::string, DefLanguage> languages = {
+        { ".c", DefLanguage::C }, { ".h", DefLanguage::C }, { ".cc", DefLanguage::C }, { ".cpp", DefLanguage::C }, 
+        { ".cxx", DefLanguage::C }, { ".hh", DefLanguage::C }, { ".hpp", DefLanguage::C }, { ".hxx", DefLanguage::C }, 
+        { ".m", DefLanguage::C }, { ".mm", DefLanguage::C }, 
+        { ".py", DefLanguage::Python }, { ".pyi", DefLanguage::Python }, 
+        { ".go", DefLanguage::Go }, 
+        { ".js", DefLanguage::JavaScript }, { ".jsx", DefLanguage::JavaScript }, { ".mjs", DefLanguage::JavaScript }, 
+        { ".ts", DefLanguage::JavaScript }, { ".tsx", DefLanguage::JavaScript }, 
+    };
+    auto it = languages.find(filename.extension().string());
+    return it == languages.end() ? DefLanguage::None : it->second;
+}
+
+static bool is_identifier_start(char c) { return isalpha((unsigned char)c) || c == '_'; }
+static bool is_identifier_char(char c) { return isalnum((unsigned char)c) || c == '_'; }
+
+static StringView trim_space(StringView text)
+{
+    while (text.length() > 0 && isspace((unsigned char)text.front())) {
+        text.remove_prefix(1);
+    }
+    while (text.length() > 0 && isspace((unsigned char)text.back())) {
+        text.remove_suffix(1);
+    }
+    return text;
+}
+
+// Returns the index of the bracket that closes the one at open, or String::npos if it's not on the line
+static Size find_closing_bracket(StringView line, Size open)
+{
+    const char open_char = line[open];
+    const char close_char = open_char == '(' ? ')' : (open_char == '<' ? '>' : ']');
+    Size depth = 0;
+    for (Size idx = open; idx < line.length(); idx++) {
+        if (line[idx] == open_char) {
+            depth++;
+        }
+        else if (line[idx] == close_char && --depth == 0) {
+            return idx;
+        }
+    }
+    return String::npos;
+}
+
+// Reads words and punctuation from the start of a line for the definition rules
+class DefLexer
+{
+public:
+    DefLexer(StringView line) : m_line(line) { skip_space(); }
+
+    Size position() const { return m_pos; }
+    bool at_end() const { return m_pos >= m_line.length(); }
+    char peek(Size ahead = 0) const { return m_pos + ahead < m_line.length() ? m_line[m_pos + ahead] : '\0'; }
+    StringView rest() const { return m_line.substr(m_pos); }
+
+    // Where the last identifier taken starts
+    Size token_start() const { return m_token_start; }
+
+    // Takes the word and the space after it, if it's next and is a whole word
+    bool take_word(StringView word) {
+        if (m_line.substr(m_pos, word.length()) != word || is_identifier_char(peek(word.length()))) {
+            return false;
+        }
+        m_pos += word.length();
+        skip_space();
+        return true;
+    }
+
+    bool take_char(char c) {
+        if (peek() != c) {
+            return false;
+        }
+        m_pos++;
+        skip_space();
+        return true;
+    }
+
+    // Takes a bracketed group, like template arguments or a receiver, and the space after it
+    bool take_group(char open) {
+        if (peek() != open) {
+            return false;
+        }
+        Size close = find_closing_bracket(m_line, m_pos);
+        if (close == String::npos) {
+            return false;
+        }
+        m_pos = close + 1;
+        skip_space();
+        return true;
+    }
+
+    // Takes an identifier and the space after it, or returns an empty view if there isn't one next
+    StringView take_identifier() {
+        if (!is_identifier_start(peek())) {
+            return StringView();
+        }
+        m_token_start = m_pos;
+        while (is_identifier_char(peek())) {
+            m_pos++;
+        }
+        StringView result = m_line.substr(m_token_start, m_pos - m_token_start);
+        skip_space();
+        return result;
+    }
+
+private:
+    void skip_space() {
+        while (!at_end() && isspace((unsigned char)m_line[m_pos])) {
+            m_pos++;
+        }
+    }
+
+    StringView m_line;
+    Size m_pos = 0;
+    Size m_token_start = 0;
+};
+
+// Words that come before a parenthesis without naming a function
+static bool is_c_control_word(StringView word)
+{
+    static const std::set<StringView> words = {
+        "if", "for", "while", "switch", "return", "sizeof", "catch", "defined", "alignof", "alignas", 
+        "decltype", "static_assert", "noexcept", "typeof", "__attribute__", "else", "new", "delete", 
+        "throw", "case", "goto", "co_return", "co_yield", "co_await", "using", "typedef", "do",
+    };
+    return words.find(word) != words.end();
+}
+
+static bool is_all_capitals(StringView word)
+{
+    return std::all_of(word.begin(), word.end(), [](char c) { return isupper((unsigned char)c) || isdigit((unsigned char)c) || c == '_'; });
+}
+
+// Macros, type aliases, classes and their kin, and function definitions. A function definition
+// is a name with a return type before it, or a qualified constructor, whose parameters aren't
+// followed by a semicolon, which would make it a declaration or a call.
+template <typename Add>
+static void find_c_definitions(StringView line, Add add)
+{
+    DefLexer lexer(line);
+    if (lexer.take_char('#')) {
+        if (lexer.take_word("define")) {
+            StringView name = lexer.take_identifier();
+            if (name.length() > 0) {
+                add(name, lexer.token_start());
+            }
+        }
+        return;
+    }
+    if (lexer.peek() == '/' || lexer.peek() == '*') {
+        return;
+    }
+
+    if (lexer.take_word("template")) {
+        if (!lexer.take_group('<')) {
+            return;
+        }
+    }
+    lexer.take_word("export");
+    if (lexer.take_word("using")) {
+        StringView name = lexer.take_identifier();
+        if (name.length() > 0 && lexer.peek() == '=' && lexer.peek(1) != '=') {
+            add(name, lexer.token_start());
+        }
+        return;
+    }
+    bool is_typedef = lexer.take_word("typedef");
+    bool is_namespace = lexer.take_word("namespace");
+    bool is_enum = !is_namespace && lexer.take_word("enum");
+    if (is_namespace || is_enum || lexer.take_word("class") || lexer.take_word("struct") || lexer.take_word("union")) {
+        if (is_enum && !lexer.take_word("class")) {
+            lexer.take_word("struct");
+        }
+        StringView name = lexer.take_identifier();
+        Size name_start = lexer.token_start();
+        // an export macro can come before the name
+        while (name.length() > 0 && is_all_capitals(name) && is_identifier_start(lexer.peek())) {
+            name = lexer.take_identifier();
+            name_start = lexer.token_start();
+        }
+        char next = lexer.peek();
+        bool defines = lexer.at_end() || next == '{' || next == '<' || (next == ':' && lexer.peek(1) != ':') || 
+            lexer.take_word("final") || (is_namespace && next == '=');
+        if (name.length() > 0 && defines) {
+            add(name, name_start);
+        }
+        return;
+    }
+    if (is_typedef) {
+        // the name comes last, unless it's a function pointer type, which isn't worth the trouble
+        StringView text = trim_space(line);
+        if (text.back() != ';' || text.find('(') != String::npos) {
+            return;
+        }
+        text.remove_suffix(1);
+        text = trim_space(text);
+        Size name_start = text.length();
+        while (name_start > 0 && is_identifier_char(text[name_start - 1])) {
+            name_start--;
+        }
+        if (name_start < text.length()) {
+            add(text.substr(name_start), text.data() + name_start - line.data());
+        }
+        return;
+    }
+
+    Size paren = line.find('(');
+    if (paren == String::npos) {
+        return;
+    }
+    StringView head = line.substr(0, paren);
+    while (head.length() > 0 && isspace((unsigned char)head.back())) {
+        head.remove_suffix(1);
+    }
+    Size qualified_start = head.length();
+    while (qualified_start > 0 && (is_identifier_char(head[qualified_start - 1]) || head[qualified_start - 1] == ':' || 
+        head[qualified_start - 1] == '~')) {
+        qualified_start--;
+    }
+    StringView qualified = head.substr(qualified_start);
+    Size name_offset = qualified.rfind("::");
+    name_offset = name_offset == String::npos ? 0 : name_offset + 2;
+    StringView name = qualified.substr(name_offset);
+    if (name.length() > 0 && name[0] == '~') {
+        name.remove_prefix(1);
+        name_offset++;
+    }
+    if (name.length() == 0 || !is_identifier_start(name[0]) || is_c_control_word(name)) {
+        return;
+    }
+
+    StringView return_type = trim_space(head.substr(0, qualified_start));
+    if (return_type.empty()) {
+        // only a constructor or destructor defined outside its class has no return type
+        StringView scope = qualified.substr(0, name_offset >= 2 ? name_offset - 2 : 0);
+        if (scope.length() > 0 && scope.back() == '~') {
+            scope.remove_suffix(1);
+        }
+        if (scope.length() > 0 && scope.back() == ':') {
+            scope.remove_suffix(2);
+        }
+        Size scope_start = scope.rfind("::");
+        scope = scope_start == String::npos ? scope : scope.substr(scope_start + 2);
+        if (scope != name) {
+            return;
+        }
+    }
+    else {
+        // the colon or comma that starts a line of member initializers isn't a type
+        if (!is_identifier_start(return_type[0]) && return_type.substr(0, 2) != "::") {
+            return;
+        }
+        for (char c : return_type) {
+            if (!is_identifier_char(c) && strchr(" \t*&<>,:", c) == nullptr) {
+                return;
+            }
+        }
+        DefLexer type_lexer(return_type);
+        if (is_c_control_word(type_lexer.take_identifier())) {
+            return;
+        }
+    }
+
+    Size close = find_closing_bracket(line, paren);
+    StringView after = close == String::npos ? line.substr(paren) : trim_space(line.substr(close + 1));
+    Size semicolon = after.find(';');
+    Size brace = after.find('{');
+    if (semicolon != String::npos && (brace == String::npos || semicolon < brace)) {
+        return;
+    }
+    if (close != String::npos && after.length() > 0 && strchr("(,).=[", after[0]) != nullptr) {
+        return;
+    }
+    add(name, qualified_start + name_offset);
+}
+
+static bool is_python_keyword(StringView word)
+{
+    static const std::set<StringView> words = {
+        "False", "None", "True", "and", "as", "assert", "async", "await", "break", "case", "class", "continue",
+        "def", "del", "elif", "else", "except", "finally", "for", "from", "global", "if", "import", "in", "is",
+        "lambda", "match", "nonlocal", "not", "or", "pass", "raise", "return", "try", "while", "with", "yield",
+    };
+    return words.find(word) != words.end();
+}
+
+template <typename Add>
+static void find_python_definitions(StringView line, Add add)
+{
+    DefLexer lexer(line);
+    bool at_top_level = lexer.position() == 0;
+    lexer.take_word("async");
+    if (lexer.take_word("def") || lexer.take_word("class")) {
+        StringView name = lexer.take_identifier();
+        if (name.length() > 0) {
+            add(name, lexer.token_start());
+        }
+        return;
+    }
+    // module constants and other top-level assignments, with or without an annotation. A colon
+    // with nothing after it ends a block statement like try: or else:, which isn't a definition.
+    if (at_top_level) {
+        StringView name = lexer.take_identifier();
+        if (name.length() == 0 || is_python_keyword(name)) {
+            return;
+        }
+        Size name_start = lexer.token_start();
+        bool is_assignment = lexer.peek() == '=' && lexer.peek(1) != '=';
+        bool is_annotation = false;
+        if (lexer.peek() == ':') {
+            StringView annotation = trim_space(lexer.rest().substr(1));
+            is_annotation = annotation.length() > 0 && annotation[0] != '#';
+        }
+        if (is_assignment || is_annotation) {
+            add(name, name_start);
+        }
+    }
+}
+
+// Go declares groups of types, constants, and variables in parentheses over several lines,
+// so the rules keep track of whether a line is inside one
+template <typename Add>
+static void find_go_definitions(StringView line, bool &in_group, Add add)
+{
+    DefLexer lexer(line);
+    if (in_group) {
+        if (lexer.peek() == ')') {
+            in_group = false;
+        }
+        else if (lexer.position() > 0) {
+            StringView name = lexer.take_identifier();
+            if (name.length() > 0) {
+                add(name, lexer.token_start());
+            }
+        }
+        return;
+    }
+    if (lexer.position() > 0) {
+        return;
+    }
+    if (lexer.take_word("func")) {
+        lexer.take_group('(');
+        StringView name = lexer.take_identifier();
+        if (name.length() > 0) {
+            add(name, lexer.token_start());
+        }
+        return;
+    }
+    if (lexer.take_word("type") || lexer.take_word("const") || lexer.take_word("var")) {
+        if (lexer.take_char('(')) {
+            in_group = true;
+            return;
+        }
+        StringView name = lexer.take_identifier();
+        if (name.length() > 0) {
+            add(name, lexer.token_start());
+        }
+    }
+}
+
+// Functions, classes, and their TypeScript kin, top-level variables, and methods, which are
+// a name and parameters followed by a brace in a class body
+template <typename Add>
+static void find_javascript_definitions(StringView line, Add add)
+{
+    static const std::set<StringView> control_words = { "if", "for", "while", "switch", "catch", "function", "return", "with" };
+    DefLexer lexer(line);
+    bool at_top_level = lexer.position() == 0;
+    while (lexer.take_word("export") || lexer.take_word("default") || lexer.take_word("declare") || 
+        lexer.take_word("abstract") || lexer.take_word("async") || lexer.take_word("static")) {
+    }
+    if (lexer.take_word("function")) {
+        lexer.take_char('*');
+        StringView name = lexer.take_identifier();
+        if (name.length() > 0) {
+            add(name, lexer.token_start());
+        }
+        return;
+    }
+    if (lexer.take_word("class") || lexer.take_word("interface") || lexer.take_word("enum")) {
+        StringView name = lexer.take_identifier();
+        if (name.length() > 0) {
+            add(name, lexer.token_start());
+        }
+        return;
+    }
+    if (lexer.take_word("type")) {
+        StringView name = lexer.take_identifier();
+        if (name.length() > 0 && (lexer.peek() == '=' || lexer.peek() == '<')) {
+            add(name, lexer.token_start());
+        }
+        return;
+    }
+    if (lexer.take_word("const") || lexer.take_word("let") || lexer.take_word("var")) {
+        StringView name = lexer.take_identifier();
+        if (at_top_level && name.length() > 0 && (lexer.peek() == '=' || lexer.peek() == ':')) {
+            add(name, lexer.token_start());
+        }
+        return;
+    }
+    if (!at_top_level) {
+        StringView name = lexer.take_identifier();
+        Size name_start = lexer.token_start();
+        if (name.length() == 0 || control_words.find(name) != control_words.end() || lexer.peek() != '(') {
+            return;
+        }
+        Size open = lexer.position();
+        Size close = find_closing_bracket(line, open);
+        StringView after = close == String::npos ? StringView() : trim_space(line.substr(close + 1));
+        if (after.length() > 0 && after.back() == '{' && after.find(';') == String::npos && after.find("=>") == String::npos) {
+            add(name, name_start);
+        }
+    }
+}
+
+// Returns the definitions in a file, with lines and columns counted after any byte order mark
+static std::vector<Definition> find_definitions_in_file(StringView source, DefLanguage language)
+{
+    std::vector<Definition> result;
+    Size line_start = 0;
+    UInt32 line_number = 0;
+    bool in_group = false;
+    while (line_start < source.length()) {
+        const char *newline = (const char *)memchr(source.data() + line_start, '\n', source.length() - line_start);
+        Size line_end = newline ? newline - source.data() : source.length();
+        StringView line = source.substr(line_start, line_end - line_start);
+        if (line.length() > 0 && line.back() == '\r') {
+            line.remove_suffix(1);
+        }
+        line_number++;
+        auto add = [&](StringView name, Size column) {
+            result.push_back({ std::string(name), line_number, UInt32(column + 1), UInt32(line_start) });
+        };
+        switch (language) {
+            case DefLanguage::C:
+                find_c_definitions(line, add);
+                break;
+            case DefLanguage::Python:
+                find_python_definitions(line, add);
+                break;
+            case DefLanguage::Go:
+                find_go_definitions(line, in_group, add);
+                break;
+            case DefLanguage::JavaScript:
+                find_javascript_definitions(line, add);
+                break;
+            case DefLanguage::None:
+                return result;
+        }
+        line_start = line_end + 1;
+    }
+    return result;
+}
+
+// Finds the definitions in a file, setting its fingerprint in the entry
+static std::vector<Definition> read_definitions(const fs::path &filename, IndexFileEntry &entry)
+{
+    if (!file_fingerprint(filename, entry.size, entry.modified)) {
+        entry.flags |= IndexFileAlwaysSearch;
+        return std::vector<Definition>();
+    }
+    DefLanguage language = def_language(filename);
+    if (language == DefLanguage::None) {
+        return std::vector<Definition>();
+    }
+    MappedFile mapped_file(filename);
+    if (mapped_file.is_valid<false>()) {
+        entry.flags |= IndexFileAlwaysSearch;
+        return std::vector<Definition>();
+    }
+    StringView source((char *)mapped_file.base(), mapped_file.file_length());
+    Size bom_length = 0;
+    if (sniff_encoding(source, bom_length) != Encoding::UTF8) {
+        entry.flags |= IndexFileAlwaysSearch;
+        return std::vector<Definition>();
+    }
+    return find_definitions_in_file(source.substr(bom_length), language);
+}
+
+class DefinitionIndex
+{
+public:
+    bool load(const fs::path &path) {
+        m_mapped_file = std::make_unique<MappedFile>(path);
+        if (m_mapped_file->is_valid<false>() || m_mapped_file->file_length() < sizeof(DefsHeader)) {
+            return false;
+        }
+        const char *base = (const char *)m_mapped_file->base();
+        m_header = (const DefsHeader *)base;
+        if (memcmp(m_header->magic, DefsMagic, sizeof(DefsMagic)) != 0) {
+            return false;
+        }
+        const UInt64 length = m_mapped_file->file_length();
+        if (!fits_within(sizeof(DefsHeader), m_header->file_count, sizeof(IndexFileEntry), m_header->defs_offset) ||
+            m_header->defs_offset % alignof(DefEntry) != 0 ||
+            !fits_within(m_header->defs_offset, m_header->def_count, sizeof(DefEntry), m_header->names_offset) ||
+            m_header->names_offset > m_header->paths_offset || m_header->paths_offset > length) {
+            return false;
+        }
+        const IndexFileEntry *files = (const IndexFileEntry *)(base + sizeof(DefsHeader));
+        m_files = IndexedFiles(files, m_header->file_count, base + m_header->paths_offset, length - m_header->paths_offset);
+        m_defs = (const DefEntry *)(base + m_header->defs_offset);
+        m_names = base + m_header->names_offset;
+        if (!m_files.is_well_formed()) {
+            return false;
+        }
+        const UInt64 names_length = m_header->paths_offset - m_header->names_offset;
+        for (Size idx = 0; idx < def_count(); idx++) {
+            const DefEntry &def = m_defs[idx];
+            if (def.file_id >= m_files.count() || !fits_within(def.name_offset, def.name_length, 1, names_length)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    const IndexedFiles &files() const { return m_files; }
+    Size def_count() const { return m_header->def_count; }
+    const DefEntry &def(Size idx) const { return m_defs[idx]; }
+    StringView name(const DefEntry &def) const { return StringView(m_names + def.name_offset, def.name_length); }
+
+    // Returns the definitions of the name, in file and line order
+    std::vector<Size> find(StringView name, SearchCase search_case) const {
+        std::vector<Size> result;
+        if (search_case == SearchCase::Sensitive) {
+            Size low = 0;
+            Size high = def_count();
+            while (low < high) {
+                Size mid = (low + high) / 2;
+                if (this->name(def(mid)) < name) {
+                    low = mid + 1;
+                }
+                else {
+                    high = mid;
+                }
+            }
+            for (; low < def_count() && this->name(def(low)) == name; low++) {
+                result.push_back(low);
+            }
+            return result;
+        }
+        auto equal_folded = [](StringView a, StringView b) {
+            return a.length() == b.length() && std::equal(a.begin(), a.end(), b.begin(), [](char x, char y) {
+                return tolower((unsigned char)x) == tolower((unsigned char)y);
+            });
+        };
+        for (Size idx = 0; idx < def_count(); idx++) {
+            if (equal_folded(this->name(def(idx)), name)) {
+                result.push_back(idx);
+            }
+        }
+        std::sort(result.begin(), result.end(), [this](Size a, Size b) {
+            return std::make_pair(def(a).file_id, def(a).line) < std::make_pair(def(b).file_id, def(b).line);
+        });
+        return result;
+    }
+
+private:
+    std::unique_ptr<MappedFile> m_mapped_file;
+    const DefsHeader *m_header = nullptr;
+    IndexedFiles m_files;
+    const DefEntry *m_defs = nullptr;
+    const char *m_names = nullptr;
+};
+
+// Builds the definitions index for every file the walk finds, carrying over the definitions
+// of files that haven't changed since the last build
+static int build_definitions(const Env &env)
+{
+    const fs::path defs_path = env.current_path() / DefsFilename;
+    std::vector<std::string> paths = walk_index_paths(env);
+
+    std::vector<IndexFileEntry> files(paths.size());
+    std::vector<std::vector<Definition>> file_defs(paths.size());
+    std::vector<bool> is_reused(paths.size(), false);
+    std::string path_bytes;
+    if (!lay_out_index_paths(paths, files, path_bytes)) {
+        std::cerr << "*** search: too many files for definitions: " << env.current_path() << std::endl;
+        return -1;
+    }
+
+    // the old definitions go back to their files by id, then over to the new ids by path
+    DefinitionIndex previous;
+    Size reused_count = 0;
+    if (previous.load(defs_path)) {
+        std::vector<std::vector<Size>> previous_defs(previous.files().count());
+        for (Size idx = 0; idx < previous.def_count(); idx++) {
+            previous_defs[previous.def(idx).file_id].push_back(idx);
+        }
+        for (Size id = 0; id < paths.size(); id++) {
+            Size found_id = previous.files().find(paths[id]);
+            if (found_id == String::npos) {
+                continue;
+            }
+            UInt32 previous_id = UInt32(found_id);
+            if (!previous.files().is_current(previous_id, env.current_path() / paths[id])) {
+                continue;
+            }
+            const IndexFileEntry &previous_entry = previous.files().entry(previous_id);
+            files[id].size = previous_entry.size;
+            files[id].modified = previous_entry.modified;
+            for (Size idx : previous_defs[previous_id]) {
+                const DefEntry &def = previous.def(idx);
+                file_defs[id].push_back({ std::string(previous.name(def)), def.line, def.column, def.line_start });
+            }
+            is_reused[id] = true;
+            reused_count++;
+        }
+    }
+
+    std::atomic<Size> next_id = 0;
+    run_index_workers(index_worker_count(), [&](Size worker) {
+        for (Size id = next_id++; id < paths.size(); id = next_id++) {
+            if (!is_reused[id]) {
+                file_defs[id] = read_definitions(env.current_path() / paths[id], files[id]);
+            }
+        }
+    });
+
+    std::vector<DefEntry> defs;
+    std::string names;
+    for (Size id = 0; id < paths.size(); id++) {
+        for (const auto &def : file_defs[id]) {
+            defs.push_back({ UInt32(names.length()), UInt32(def.name.length()), UInt32(id), def.line, def.column, def.line_start });
+            names += def.name;
+        }
+    }
+    // every name starts before the end of the names, so checking its length covers the offsets too
+    if (defs.size() > UINT32_MAX || names.length() > UINT32_MAX) {
+        std::cerr << "*** search: too many definitions to index: " << env.current_path() << std::endl;
+        return -1;
+    }
+    std::stable_sort(defs.begin(), defs.end(), [&names](const DefEntry &a, const DefEntry &b) {
+        return StringView(names.data() + a.name_offset, a.name_length) < StringView(names.data() + b.name_offset, b.name_length);
+    });
+
+    DefsHeader header;
+    memcpy(header.magic, DefsMagic, sizeof(DefsMagic));
+    header.file_count = UInt32(files.size());
+    header.def_count = UInt32(defs.size());
+    header.defs_offset = sizeof(DefsHeader) + files.size() * sizeof(IndexFileEntry);
+    header.names_offset = header.defs_offset + defs.size() * sizeof(DefEntry);
+    header.paths_offset = header.names_offset + names.length();
+
+    // the previous index is still mapped, so the new one replaces it rather than overwriting it
+    bool written = write_index_file(defs_path, [&](std::ofstream &file) {
+        file.write((const char *)&header, sizeof(header));
+        file.write((const char *)files.data(), files.size() * sizeof(IndexFileEntry));
+        file.write((const char *)defs.data(), defs.size() * sizeof(DefEntry));
+        file.write(names.data(), names.length());
+        file.write(path_bytes.data(), path_bytes.length());
+    });
+    if (!written) {
+        std::cerr << "*** search: unable to write definitions: " << defs_path << std::endl;
+        return -1;
+    }
+
+    std::cout << "found " << defs.size() << " definitions in " << files.size() << " files, " << 
+        files.size() - reused_count << " read and " << reused_count << " unchanged" << std::endl;
+    return 0;
+}
+
+// Moves an index back to the start of the UTF-8 character that contains it
+static Size utf8_character_start(StringView source, Size index)
+{
+    while (index > 0 && index < source.length() && (source[index] & 0xC0) == 0x80) {
+        index--;
+    }
+    return index;
+}
+
+// Counts the columns taken up by a run of UTF-8 text. Codepoints are the bytes that aren't
+// continuation bytes, and UTF-16 adds a second unit for each four-byte sequence. Eight bytes
+// are checked at a time, and words with no high bits set are all ASCII and skipped at once.
+static Size count_columns(StringView text, ColumnUnit column_unit)
+{
+    if (column_unit == ColumnUnit::Bytes) {
+        return text.length();
+    }
+
+    const UInt64 high_bits = 0x8080808080808080ULL;
+    const char *data = text.data();
+    const Size length = text.length();
+    Size continuation_bytes = 0;
+    Size four_byte_leads = 0;
+    Size idx = 0;
+    for (; idx + sizeof(UInt64) <= length; idx += sizeof(UInt64)) {
+        UInt64 word;
+        memcpy(&word, data + idx, sizeof(UInt64));
+        if ((word & high_bits) == 0) {
+            continue;
+        }
+        // shifting moves each byte's lower bits under its own high bit: 10xxxxxx is a
+        // continuation byte and 1111xxxx starts a four-byte sequence
+        continuation_bytes += std::popcount(word & ~(word << 1) & high_bits);
+        if (column_unit == ColumnUnit::UTF16) {
+            four_byte_leads += std::popcount(word & (word << 1) & (word << 2) & (word << 3) & high_bits);
+        }
+    }
+    for (; idx < length; idx++) {
+        unsigned char c = data[idx];
+        continuation_bytes += (c & 0xC0) == 0x80;
+        four_byte_leads += c >= 0xF0;
+    }
+
+    Size columns = length - continuation_bytes;
+    if (column_unit == ColumnUnit::UTF16) {
+        columns += four_byte_leads;
+    }
+    return columns;
+}
+
+// Returns the text of a line, or if it's longer than max_columns, a window of
+// that many bytes around the given match index with ellipses at the cut ends.
+static String line_text(StringView source, Size line_start, Size line_length, Size match_index, Size max_columns, 
+    bool *truncated = nullptr)
+{
+    if (max_columns == 0 || line_length <= max_columns) {
+        if (truncated) {
+            *truncated = false;
+        }
+        return String(source.substr(line_start, line_length));
+    }
+    Size line_end = line_start + line_length;
+    Size window_start = match_index > line_start + max_columns / 2 ? match_index - max_columns / 2 : line_start;
+    window_start = std::min(window_start, line_end - max_columns);
+    Size window_end = window_start + max_columns;
+    window_start = utf8_character_start(source, window_start);
+    window_end = utf8_character_start(source, window_end);
+
+    String result;
+    result.reserve(max_columns + 6);
+    if (window_start > line_start) {
+        result += "...";
+    }
+    result += source.substr(window_start, window_end - window_start);
+    if (window_end < line_end) {
+        result += "...";
+    }
+    if (truncated) {
+        *truncated = true;
+    }
+    return result;
+}
+
+// Each kernel calls emit for every match it finds in start index order,
+// and stops early, returning false, if emit returns false.
+
+template <typename Emit>
+static bool memchr_scan(StringView haystack, const LiteralNeedle &needle, Emit &&emit)
+{
+    const Size length = needle.length();
+    if (length == 0 || length > haystack.length()) {
+        return true;
+    }
+
+    // look for the needle's rarest byte, then check the whole needle around it
+    const Size rare_byte_offset = needle.rare_byte_offset();
+    const char rare_byte = needle.text()[rare_byte_offset];
+    const char *base = haystack.data();
+    const char *ptr = base + rare_byte_offset;
+    const char *end = base + haystack.length() - length + rare_byte_offset + 1;
+    while (ptr < end) {
+        const char *hit = (const char *)memchr(ptr, rare_byte, end - ptr);
+        if (hit == nullptr) {
+            break;
+        }
+        const char *candidate = hit - rare_byte_offset;
+        if (memcmp(candidate, needle.text().data(), length) == 0) {
+            if (!emit(Match(needle.index(), candidate - base, length))) {
+                return false;
+            }
+        }
+        ptr = hit + 1;
+    }
+    return true;
+}
+
+template <typename Emit>
+static bool boyer_moore_scan(StringView haystack, const LiteralNeedle &needle, Emit &&emit)
+{
+    if (needle.is_empty()) {
+        return true;
+    }
+    const auto searcher = std::boyer_moore_searcher(needle.text().begin(), needle.text().end());
+    auto hit = haystack.begin();
+    while (true) {
+        auto it = std::search(hit, haystack.end(), searcher);
+        if (it == haystack.end()) {
+            break;
+        }
+        if (!emit(Match(needle.index(), it - haystack.begin(), needle.length()))) {
+            return false;
+        }
+        hit = ++it;
+    }
+    return true;
+}
+
+template <typename Emit>
+static bool multi_literal_scan(StringView haystack, const QueryPlan &plan, Emit &&emit)
+{
+    const auto &literals = plan.literals();
+    const char *base = haystack.data();
+    const Size haystack_length = haystack.length();
+
+    // check every needle that starts with the byte at the given position
+    auto check_position = [&](Size pos) {
+        for (Size literal_index : plan.first_byte_bucket(base[pos])) {
+            const auto &literal = literals[literal_index];
+            if (literal.length() <= haystack_length - pos && memcmp(base + pos, literal.text().data(), literal.length()) == 0) {
+                if (!emit(Match(literal.index(), pos, literal.length()))) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    };
+
+    // when all the needles start with the same byte, memchr can skip to candidates
+    if (plan.distinct_first_byte_count() == 1) {
+        const char first_byte = plan.single_first_byte();
+        const char *ptr = base;
+        const char *end = base + haystack_length;
+        while (ptr < end) {
+            const char *hit = (const char *)memchr(ptr, first_byte, end - ptr);
+            if (hit == nullptr) {
+                break;
+            }
+            if (!check_position(hit - base)) {
+                return false;
+            }
+            ptr = hit + 1;
+        }
+        return true;
+    }
+
+    for (Size pos = 0; pos < haystack_length; pos++) {
+        if (plan.is_first_byte(base[pos]) && !check_position(pos)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Runs the regex over a single line, so ^ and $ anchor at its ends, as in grep
+template <typename Emit>
+static bool regex_scan_line(StringView line, Size line_start, Size needle_index, const std::regex &regex_needle,
+    Emit &&emit)
+{
+    const auto searcher_begin = std::cregex_iterator(line.begin(), line.end(), regex_needle);
+    auto searcher_end = std::cregex_iterator();
+    for (auto it = searcher_begin; it != searcher_end; ++it) {
+        const auto &match = *it;
+        if (!emit(Match(needle_index, line_start + match.position(), match.length()))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Runs the regex over each line in turn. Every regex kernel other than the multiline one
+// matches line by line, so the kernel the plan picks never changes what a regex matches.
+template <typename Emit>
+static bool regex_scan(StringView haystack, Size needle_index, const std::regex &regex_needle, Emit &&emit)
+{
+    const char *base = haystack.data();
+    const Size haystack_length = haystack.length();
+    Size line_start = 0;
+    while (line_start < haystack_length) {
+        const char *newline = (const char *)memchr(base + line_start, '\n', haystack_length - line_start);
+        Size line_end = newline ? newline - base : haystack_length;
+        StringView line = haystack.substr(line_start, line_end - line_start);
+        if (!regex_scan_line(line, line_start, needle_index, regex_needle, emit)) {
+            return false;
+        }
+        line_start = line_end + 1;
+    }
+    return true;
+}
+
+template <typename Emit>
+static bool prefiltered_regex_scan(StringView haystack, const LiteralNeedle &prefilter, const std::regex &regex_needle, 
+    Emit &&emit)
+{
+    // find the literal every match must contain, then run the regex over only the line that contains it
+    const char *base = haystack.data();
+    const Size haystack_length = haystack.length();
+    Size line_start = 0;
+    Size pos = 0;
+    while (pos < haystack_length) {
+        Size hit = String::npos;
+        memchr_scan(haystack.substr(pos), prefilter, [&](const Match &match) {
+            hit = pos + match.match_start_index();
+            return false;
+        });
+        if (hit == String::npos) {
+            break;
+        }
+        for (Size idx = hit; idx > pos; idx--) {
+            if (base[idx - 1] == '\n') {
+                line_start = idx;
+                break;
+            }
+        }
+        const char *newline = (const char *)memchr(base + hit, '\n', haystack_length - hit);
+        Size line_end = newline ? newline - base : haystack_length;
+        StringView line = haystack.substr(line_start, line_end - line_start);
+        if (!regex_scan_line(line, line_start, prefilter.index(), regex_needle, emit)) {
+            return false;
+        }
+        pos = line_end + 1;
+        line_start = pos;
+    }
+    return true;
+}
+
+static constexpr Size MultilineWindowLines = 64;
+
+// Runs a regex that can match across lines. A match can span at most MultilineWindowLines
+// lines, so the regex only runs over windows of twice that many lines. Matches that start
+// in the first half of a window are kept, then the window moves on by half. However many
+// partial matches a file has, no attempt scans past the end of its window. When the regex
+// requires a literal, the search skips ahead to the windows near the next hit for it.
+template <typename Emit>
+static bool multiline_regex_scan(StringView haystack, const LiteralNeedle &prefilter, const std::regex &regex_needle,
+    Emit &&emit)
+{
+    const char *base = haystack.data();
+    const Size length = haystack.length();
+
+    // returns the index just past the given number of newlines after pos, or the length
+    auto skip_lines = [&](Size pos, Size count) {
+        for (; count > 0 && pos < length; count--) {
+            const char *newline = (const char *)memchr(base + pos, '\n', length - pos);
+            pos = newline ? newline - base + 1 : length;
+        }
+        return pos;
+    };
+
+    // ^ and $ must see the text around a window, not take its ends as the ends of the file
+    auto search = [&](Size start, Size end, std::cmatch &match, std::regex_constants::match_flag_type flags) {
+        if (start > 0) {
+            flags |= std::regex_constants::match_prev_avail;
+        }
+        if (end < length) {
+            flags |= std::regex_constants::match_not_eol;
+        }
+        return std::regex_search(base + start, base + end, match, regex_needle, flags);
+    };
+
+    Size window_start = 0;
+    Size resume = 0;
+    while (window_start < length) {
+        if (!prefilter.is_empty()) {
+            Size from = std::max(window_start, resume);
+            Size hit = String::npos;
+            memchr_scan(haystack.substr(from), prefilter, [&](const Match &match) {
+                hit = from + match.match_start_index();
+                return false;
+            });
+            if (hit == String::npos) {
+                break;
+            }
+            // a match containing the hit starts at most MultilineWindowLines - 1 lines before it
+            Size earliest = find_line_start(haystack, hit, Encoding::UTF8);
+            for (Size count = 1; count < MultilineWindowLines && earliest > window_start; count++) {
+                earliest = find_line_start(haystack, earliest - 1, Encoding::UTF8);
+            }
+            window_start = std::max(window_start, earliest);
+        }
+
+        Size window_middle = skip_lines(window_start, MultilineWindowLines);
+        Size window_end = skip_lines(window_middle, MultilineWindowLines);
+        Size pos = std::max(window_start, resume);
+        while (pos < window_middle) {
+            std::cmatch match;
+            if (!search(pos, window_end, match, std::regex_constants::match_default)) {
+                break;
+            }
+            Size match_start = pos + match.position();
+            if (match_start >= window_middle) {
+                break;
+            }
+            Size match_length = match.length();
 
-private:
-    fs::path m_current_path;
-    std::vector<String> m_string_needles;
-    std::vector<std::regex> m_regex_needles;
-    String m_replacement;
-    TextRef::FilenameFormat m_filename_format;
-    HighlightColor m_highlight_color;
-    MatchType m_match_type;
-    MergeSpreads m_merge_spreads;
-    Mode m_mode;
-    SearchCase m_search_case;
-    Skip m_skip;
-    LimitToSearchables m_limit_to_searchables;
-};
+            // a match that runs past its own lines is found again within them, so it's
+            // the same match no matter where the window started
+            Size match_limit = skip_lines(match_start, MultilineWindowLines);
+            if (match_start + match_length > match_limit) {
+                if (!search(match_start, match_limit, match, std::regex_constants::match_continuous)) {
+                    pos = match_start + 1;
+                    continue;
+                }
+                match_length = match.length();
+            }
 
-static HighlightColor highlight_color_from_string(const String &s)
+            if (!emit(Match(prefilter.index(), match_start, match_length))) {
+                return false;
+            }
+            resume = match_start + std::max<Size>(match_length, 1);
+            pos = resume;
+        }
+        window_start = window_middle;
+    }
+    return true;
+}
+
+// Splits each match that spans lines into a match for each line, leaving out the newlines
+static void split_multiline_matches(StringView source, std::vector<Match> &matches)
 {
-    std::map<String, HighlightColor> highlight_colors = {
-        {"black", HighlightColor::Black},
-        {"gray", HighlightColor::Gray},
-        {"red", HighlightColor::Red},
-        {"green", HighlightColor::Green},
-        {"yellow", HighlightColor::Yellow},
-        {"blue", HighlightColor::Blue},
-        {"magenta", HighlightColor::Magenta},
-        {"cyan", HighlightColor::Cyan},
-        {"white", HighlightColor::White},
+    std::vector<Match> split_matches;
+    split_matches.reserve(matches.size());
+    bool has_split = false;
+    for (const auto &match : matches) {
+        Size start = match.spread().first();
+        Size end = match.spread().last();
+        const char *newline = nullptr;
+        while (start < end && (newline = (const char *)memchr(source.data() + start, '\n', end - start)) != nullptr) {
+            Size newline_index = newline - source.data();
+            split_matches.emplace_back(match.needle_index(), start, newline_index - start);
+            start = newline_index + 1;
+            has_split = true;
+        }
+        // a match that ends with a newline doesn't reach into the next line
+        if (start < end || start == match.spread().first()) {
+            split_matches.emplace_back(match.needle_index(), start, end - start);
+        }
+    }
+    if (!has_split) {
+        return;
+    }
+    // matches for different needles can overlap, so their pieces may need sorting
+    std::stable_sort(split_matches.begin(), split_matches.end(), [](const Match &a, const Match &b) {
+        return a.match_start_index() < b.match_start_index();
+    });
+    matches = std::move(split_matches);
+}
+
+// Runs the kernel the plan picks for its literal needles over the haystack
+template <typename Emit>
+static void literal_scan(StringView haystack, const QueryPlan &plan, Emit &&emit)
+{
+    Kernel kernel = plan.literal_kernel(haystack.length());
+    g_stats.add_kernel_use(kernel);
+    switch (kernel) {
+        case Kernel::Memchr:
+            memchr_scan(haystack, plan.literals().front(), emit);
+            break;
+        case Kernel::BoyerMoore:
+            boyer_moore_scan(haystack, plan.literals().front(), emit);
+            break;
+        default:
+            multi_literal_scan(haystack, plan, emit);
+            break;
+    }
+}
+
+// Returns the start index of the first match for the given needle, or String::npos.
+// Literal needles are found in the haystack and regex needles in the source.
+static Size find_first_match(StringView haystack, StringView source, Size needle_index, const Env &env)
+{
+    const QueryPlan &plan = env.plan();
+    Size result = String::npos;
+    auto first_match = [&result](const Match &match) {
+        result = match.match_start_index();
+        return false;
     };
+    if (needle_index < plan.string_needle_count()) {
+        memchr_scan(haystack, plan.literals()[needle_index], first_match);
+    }
+    else {
+        Size regex_index = needle_index - plan.string_needle_count();
+        regex_scan(source, needle_index, env.regex_needles()[regex_index], first_match);
+    }
+    return result;
+}
 
-    const auto r = highlight_colors.find(s);
-    return r == highlight_colors.end() ? HighlightColor::None : r->second;
+// Returns true as soon as a line is found that contains a match for every needle.
+// Finds each line holding the first needle in the order, then checks only that line
+// for the others. With an index, the order puts the needles in the fewest files first,
+// so the lines to check are as few as they can be, and the checks fail as soon as they can.
+static bool has_line_matching_all_needles(StringView haystack, StringView source, Size needle_count, const Env &env)
+{
+    std::vector<Size> needle_order = g_index_filter.needle_order();
+    if (needle_order.size() != needle_count) {
+        needle_order.resize(needle_count);
+        std::iota(needle_order.begin(), needle_order.end(), 0);
+    }
+    Size pos = 0;
+    while (pos <= haystack.length()) {
+        Size hit = find_first_match(haystack.substr(pos), source.substr(pos), needle_order[0], env);
+        if (hit == String::npos) {
+            return false;
+        }
+        hit += pos;
+        Size line_start = hit;
+        while (line_start > pos && haystack[line_start - 1] != '\n') {
+            line_start--;
+        }
+        LineScanner line_scanner(haystack.substr(line_start));
+        Size line_end = line_start + line_scanner.line_end();
+        StringView haystack_line = haystack.substr(line_start, line_end - line_start);
+        StringView source_line = source.substr(line_start, line_end - line_start);
+        bool matches_all = true;
+        for (Size idx = 1; idx < needle_count; idx++) {
+            if (find_first_match(haystack_line, source_line, needle_order[idx], env) == String::npos) {
+                matches_all = false;
+                break;
+            }
+        }
+        if (matches_all) {
+            return true;
+        }
+        pos = line_end + 1;
+    }
+    return false;
 }
 
-static std::vector<fs::path> build_file_list(const Env &env, const fs::path &dir)
+// Copies the context lines around each match out of the mapped source, scanning
+// for newlines outward from the match's line. When the context windows of two
+// matches meet or overlap, every line between them goes with the first match.
+static void add_context_lines(StringView source, const std::vector<Match> &matches, FileResults &results, Size max_columns,
+    Encoding encoding, const Env &env)
 {
-    std::vector<fs::path> result;
-    fs::directory_options options = fs::directory_options::skip_permission_denied;
-    for (auto it = fs::recursive_directory_iterator(dir, options); it != fs::recursive_directory_iterator(); ++it) {
-        const fs::directory_entry &dir_entry = *it;
-        const fs::path &path = dir_entry.path();
-        if (dir_entry.is_directory() && env.skip() == Skip::SkipSkippables && UU::is_skippable(UU::skippable_paths(), path)) {
-            it.disable_recursion_pending();
-            continue;
+    const Size before_context = env.before_context();
+    const Size after_context = env.after_context();
+    const Size window_gap = before_context + after_context + 1;
+    const Size newline = newline_length(encoding);
+
+    auto context_line_text = [&](Size line_start, Size line_end) {
+        if (encoding == Encoding::UTF8) {
+            return line_text(source, line_start, line_end - line_start, line_start, max_columns);
         }
-        if (!dir_entry.is_regular_file()) {
-            continue;
+        String decoded_line = decode_utf16(source.substr(line_start, line_end - line_start), encoding);
+        return line_text(decoded_line, 0, decoded_line.length(), 0, max_columns);
+    };
+
+    results.contexts.resize(matches.size());
+    for (Size idx = 0; idx < matches.size(); idx++) {
+        const Match &match = matches[idx];
+        RefContext &context = results.contexts[idx];
+
+        bool joins_previous = idx > 0 && match.line() <= matches[idx - 1].line() + window_gap;
+        if (!joins_previous) {
+            context.starts_group = true;
+            Size line = match.line();
+            Size line_start = match.line_start_index();
+            while (line > 1 && context.before.size() < before_context) {
+                Size line_end = line_start - newline;
+                line_start = find_line_start(source, line_end, encoding);
+                line--;
+                context.before.push_back({ line, context_line_text(line_start, line_end) });
+            }
+            std::reverse(context.before.begin(), context.before.end());
         }
-        if (env.limit_to_searchables() == LimitToSearchables::No || UU::is_searchable(UU::searchable_paths(), path)) {
-            result.push_back(path);
+
+        Size last_line = match.line() + after_context;
+        if (idx + 1 < matches.size() && matches[idx + 1].line() <= match.line() + window_gap) {
+            last_line = matches[idx + 1].line() - 1;
+        }
+        Size line = match.line();
+        Size line_end = match.line_start_index() + match.line_length();
+        while (line < last_line && line_end + newline < source.length()) {
+            Size line_start = line_end + newline;
+            line_end = find_newline(source, line_start, encoding);
+            line++;
+            context.after.push_back({ line, context_line_text(line_start, line_end) });
         }
     }
-    return result;
 }
 
-class Match
+static constexpr Size DiffContextLines = 3;
+
+// Makes a unified diff for a search and replace, given the new text for each changed line.
+// Context lines are copied out of the mapped source around each change, and changes close
+// enough for their context to meet share a hunk, as with diff -u.
+static String unified_diff(StringView source, StringView bom, const std::vector<Match> &matches,
+    const std::vector<String> &new_lines, const fs::path &filename, const Env &env)
 {
-public:
-    Match() {}
-    Match(Size needle_index, Size match_start_index, Size match_length) : 
-        m_needle_index(needle_index), m_spread(match_start_index, match_start_index + match_length) {}
+    const Size before_context = env.before_context();
+    const Size after_context = env.after_context();
+    const String path = String(fs::relative(filename, env.current_path()));
 
-    Size needle_index() const { return m_needle_index; }
-    void set_needle_index(Size needle_index) { m_needle_index = needle_index; }
+    String diff;
+    diff += "--- a/";
+    diff += path;
+    diff += "\n+++ b/";
+    diff += path;
+    diff += '\n';
 
-    Size match_start_index() const { return m_spread.first(); }
+    // the byte order mark goes back on the first line so the diff applies to the file as it is,
+    // and a replacement with newlines in it continues as more lines with the same prefix
+    auto add_line = [&bom](String &hunk, char prefix, Size line, StringView text, bool has_newline) {
+        hunk += prefix;
+        if (line == 1) {
+            hunk += bom;
+        }
+        for (char c : text) {
+            hunk += c;
+            if (c == '\n') {
+                hunk += prefix;
+            }
+        }
+        hunk += '\n';
+        if (!has_newline) {
+            hunk += "\\ No newline at end of file\n";
+        }
+    };
 
-    const Spread<Size> &spread() const { return m_spread; }
-    void add_spread(const Spread<Size> &spread) { m_spread.add(spread); }
-    void simplify_spread() { m_spread.simplify(); }
+    String hunk;
+    Size added_lines = 0;
+    Size idx = 0;
+    while (idx < matches.size()) {
+        // take in every following change whose context meets the context of the one before
+        Size end = idx + 1;
+        while (end < matches.size() && matches[end].line() - matches[end - 1].line() - 1 <= before_context + after_context) {
+            end++;
+        }
 
-    Size line_start_index() const { return m_line_start_index; }
-    void set_line_start_index(Size line_start_index) { m_line_start_index = line_start_index; }
+        // back up over the context before the first change
+        Size line = matches[idx].line();
+        Size line_start = matches[idx].line_start_index();
+        for (Size count = 0; count < before_context && line > 1; count++) {
+            line_start = find_line_start(source, line_start - 1, Encoding::UTF8);
+            line--;
+        }
+        const Size old_start = line;
+        Size old_count = 0;
+        Size new_count = 0;
+        hunk.clear();
 
-    Size line_length() const { return m_line_length; }
-    void set_line_length(Size line_length) { m_line_length = line_length; }
+        auto add_context_line = [&]() {
+            Size line_end = find_newline(source, line_start, Encoding::UTF8);
+            add_line(hunk, ' ', line, source.substr(line_start, line_end - line_start), line_end < source.length());
+            old_count++;
+            new_count++;
+            line_start = line_end + 1;
+            line++;
+        };
 
-    Size line() const { return m_line; }
-    void set_line(Size line) { m_line = line; }
+        for (Size change = idx; change < end; change++) {
+            const Match &match = matches[change];
+            while (line < match.line()) {
+                add_context_line();
+            }
+            Size line_end = match.line_start_index() + match.line_length();
+            bool has_newline = line_end < source.length();
+            const String &new_line = new_lines[change];
+            add_line(hunk, '-', line, source.substr(match.line_start_index(), match.line_length()), has_newline);
+            add_line(hunk, '+', line, new_line, has_newline);
+            old_count++;
+            new_count += 1 + std::count(new_line.begin(), new_line.end(), '\n');
+            line_start = line_end + 1;
+            line++;
+        }
+        for (Size count = 0; count < after_context && line_start < source.length(); count++) {
+            add_context_line();
+        }
 
-    Size column() const { return match_start_index() - m_line_start_index; }
+        diff += "@@ -";
+        diff += std::to_string(old_start);
+        diff += ',';
+        diff += std::to_string(old_count);
+        diff += " +";
+        diff += std::to_string(old_start + added_lines);
+        diff += ',';
+        diff += std::to_string(new_count);
+        diff += " @@\n";
+        diff += hunk;
 
-private:
-    Size m_needle_index = 0;
-    Spread<Size> m_spread;
-    Size m_line_start_index = 0;
-    Size m_line_length = 0;
-    Size m_line = 0;
-};
+        added_lines += new_count - old_count;
+        idx = end;
+    }
+    return diff;
+}
 
-void process_file(const fs::path &filename, const Env &env)
+// Searches the raw bytes of a file for hex needles. There are no lines, so each
+// match is a result of its own, and --max-count counts matches.
+static void process_bytes(Size file_index, FileResults &results, StringView source, const Env &env)
 {
-#if !USE_DISPATCH
-    // The guard releases the semaphore regardless of how the function exits
-    UU::AcquireReleaseGuard semaphore_guard(g_semaphore);
-#endif
+    g_stats.add_searched_file(source.length());
+
+    bool lists_files = env.report() == Report::FilesWithMatches || env.report() == Report::FilesWithoutMatch;
+    std::vector<ByteOffset> offsets;
+    literal_scan(source, env.plan(), [&](const Match &match) {
+        if (g_limiter.is_cancelled(file_index)) {
+            return false;
+        }
+        offsets.push_back({ match.match_start_index(), match.needle_index() });
+        return !lists_files && (env.max_count() == 0 || offsets.size() < env.max_count());
+    });
+
+    if (g_limiter.is_cancelled(file_index)) {
+        g_stats.add_cancelled_file();
+        return;
+    }
+
+    if (lists_files) {
+        if ((offsets.size() > 0) == (env.report() == Report::FilesWithMatches)) {
+            results.refs.emplace_back(0, results.filename);
+        }
+        return;
+    }
+    if (offsets.size() == 0) {
+        return;
+    }
+    if (env.report() == Report::Count) {
+        results.refs.emplace_back(0, results.filename);
+        results.count = offsets.size();
+        return;
+    }
+    for (Size idx = 0; idx < offsets.size(); idx++) {
+        results.refs.emplace_back(0, results.filename);
+    }
+    results.offsets = std::move(offsets);
+}
+
+// Keeps the matches that fall in some window of the given number of lines that holds
+// a match for every needle. The window slides along the matches, which are in order,
+// keeping count of how many matches for each needle are inside it.
+static void keep_matches_within(std::vector<Match> &matches, Size needle_count, Size window_lines)
+{
+    std::vector<Size> needle_match_counts(needle_count, 0);
+    Size needles_in_window = 0;
+    std::vector<bool> keeps(matches.size(), false);
+    Size first_unkept = 0;
+    Size left = 0;
+    for (Size right = 0; right < matches.size(); right++) {
+        if (needle_match_counts[matches[right].needle_index()]++ == 0) {
+            needles_in_window++;
+        }
+        while (matches[right].line() - matches[left].line() >= window_lines) {
+            if (--needle_match_counts[matches[left].needle_index()] == 0) {
+                needles_in_window--;
+            }
+            left++;
+        }
+        // the window ending here is the largest one, so if it qualifies, so does everything in it
+        if (needles_in_window == needle_count) {
+            for (Size idx = std::max(left, first_unkept); idx <= right; idx++) {
+                keeps[idx] = true;
+            }
+            first_unkept = right + 1;
+        }
+    }
+
+    Size kept_count = 0;
+    for (Size idx = 0; idx < matches.size(); idx++) {
+        if (keeps[idx]) {
+            matches[kept_count++] = matches[idx];
+        }
+    }
+    matches.resize(kept_count);
+}
+
+// Returns the replacement with the case pattern of the text it replaces. If that's all
+// capitals, so is the replacement. Otherwise the replacement's first letter is capitalized
+// or lowercased to match the first letter replaced. Only ASCII letters are considered.
+static String replacement_with_case(StringView replaced, const String &replacement)
+{
+    Size upper_count = 0;
+    Size lower_count = 0;
+    unsigned char first_letter = 0;
+    for (unsigned char c : replaced) {
+        if (!isalpha(c)) {
+            continue;
+        }
+        if (first_letter == 0) {
+            first_letter = c;
+        }
+        if (isupper(c)) {
+            upper_count++;
+        }
+        else {
+            lower_count++;
+        }
+    }
+
+    String result = replacement;
+    if (first_letter == 0) {
+        return result;
+    }
+    // a lone capital reads as capitalized rather than all capitals
+    if (upper_count > 1 && lower_count == 0) {
+        for (auto &c : result) {
+            c = toupper((unsigned char)c);
+        }
+        return result;
+    }
+    auto it = std::find_if(result.begin(), result.end(), [](unsigned char c) { return isalpha(c); });
+    if (it != result.end()) {
+        *it = isupper(first_letter) ? toupper((unsigned char)*it) : tolower((unsigned char)*it);
+    }
+    return result;
+}
+
+void process_file(Size file_index, FileResults &results, const Env &env)
+{
+    const fs::path &filename = results.filename;
+
+    // a file the index or its filter rules out is known to have no matches without searching it.
+    // -L still opens it, since it only lists the files that would have been searched without the index.
+    bool is_ruled_out = !g_index_filter.should_search(filename, env) ||
+        !g_file_filters.should_search(filename, env, results.passed_filter);
+    if (is_ruled_out) {
+        g_stats.add_index_skipped_file();
+        if (env.report() != Report::FilesWithoutMatch) {
+            return;
+        }
+    }
 
     MappedFile mapped_file(filename);
     if (mapped_file.is_valid<false>()) {
@@ -229,43 +5031,176 @@ void process_file(const fs::path &filename, const Env &env)
     }
 
     StringView source((char *)mapped_file.base(), mapped_file.file_length());
-    StringView haystack((char *)mapped_file.base(), mapped_file.file_length());
+
+    // byte searches skip the binary check and all the text handling below
+    if (env.needle_format() == NeedleFormat::Hex) {
+        if (is_ruled_out) {
+            results.refs.emplace_back(0, filename);
+        }
+        else {
+            process_bytes(file_index, results, source, env);
+        }
+        return;
+    }
+
+    // UTF-16 files are searched for literal needles, but never rewritten. Otherwise they're
+    // left to the binary check like any other file with NUL bytes in it.
+    Size bom_length = 0;
+    Encoding encoding = sniff_encoding(source, bom_length);
+    if (encoding != Encoding::UTF8 && (env.regex_needles().size() > 0 || env.mode() != Mode::Search)) {
+        encoding = Encoding::UTF8;
+        bom_length = 0;
+    }
+
+    // a byte order mark isn't part of the text, so lines and columns start after it
+    StringView bom = source.substr(0, bom_length);
+    source = source.substr(bom_length);
+    StringView haystack = source;
+
+    if (encoding != Encoding::UTF8) {
+        g_stats.add_utf16_file();
+    }
+    else if (env.limit_to_searchables() == LimitToSearchables::Yes && is_binary(source)) {
+        g_stats.add_binary_file();
+        return;
+    }
+
+    // minified files are searched with a column limit unless they're skipped entirely
+    Size max_columns = env.max_columns();
+    if (looks_minified(source)) {
+        g_stats.add_minified_file();
+        if (env.skip_minified() == SkipMinified::Yes) {
+            return;
+        }
+        if (max_columns == 0) {
+            max_columns = MinifiedMaxColumns;
+        }
+    }
+
+    if (is_ruled_out) {
+        results.refs.emplace_back(0, filename);
+        return;
+    }
+
+    g_stats.add_searched_file(source.length());
+
+    const QueryPlan &plan = env.plan().for_encoding(encoding);
     
     String case_folded_string;
-    if (env.search_case() == SearchCase::Insensitive) {
-        case_folded_string = String(haystack);
-        std::transform(case_folded_string.cbegin(), case_folded_string.cend(), case_folded_string.begin(), 
-            [](unsigned char c) { return std::tolower(c); });
+    if (plan.folds_haystack()) {
+        if (encoding == Encoding::UTF8) {
+            case_folded_string = fold_case(haystack, plan.folds_unicode());
+        }
+        else {
+            case_folded_string = fold_case_utf16(haystack, encoding, plan.folds_unicode());
+        }
         haystack = case_folded_string;
     }
 
+    Size needle_count = env.string_needles().size() + env.regex_needles().size();
+
+    // only the existence of a qualifying line matters when listing files
+    bool lists_files = env.report() == Report::FilesWithMatches || env.report() == Report::FilesWithoutMatch;
+    auto list_file = [&](bool has_match) {
+        if (has_match == (env.report() == Report::FilesWithMatches)) {
+            results.refs.emplace_back(0, filename);
+        }
+    };
+    if (lists_files && env.match_type() == MatchType::All && needle_count > 1 && encoding == Encoding::UTF8 && 
+        !plan.is_multiline() && !plan.has_exclusions()) {
+        list_file(has_line_matching_all_needles(haystack, source, needle_count, env));
+        return;
+    }
+
+    // with more than one needle, or any exclusions, matches only count once they're checked against each other
+    bool filters_matches = (needle_count > 1 && env.match_type() != MatchType::Any) || plan.has_exclusions();
+
+    // with a single kernel finding every match in order, and every match qualifying its line,
+    // the scan can stop as soon as it reaches the line after the per-file maximum
+    Size kernel_count = (plan.literals().size() > 0 ? 1 : 0) + env.regex_needles().size();
+    bool stops_at_max_count = env.max_count() > 0 && kernel_count == 1 && !plan.has_exclusions() && 
+        (env.match_type() == MatchType::Any || needle_count == 1);
+    LineScanner max_count_scanner(haystack, encoding);
+    Size max_count_lines = 0;
+
     std::vector<Match> matches;
-    Size needle_index = 0;
+    std::vector<bool> seen_literals(plan.string_needle_count(), false);
+    Size seen_literal_count = 0;
+    auto add_match = [&](const Match &match) {
+        if (g_limiter.is_cancelled(file_index)) {
+            return false;
+        }
+        // the bytes of a UTF-16 needle can also turn up straddling two characters
+        if (encoding != Encoding::UTF8 && match.match_start_index() % 2 != 0) {
+            return true;
+        }
+        if (stops_at_max_count) {
+            Size previous_line = max_count_scanner.line();
+            max_count_scanner.advance_to(match.match_start_index());
+            if (max_count_lines == 0 || max_count_scanner.line() != previous_line) {
+                if (max_count_lines == env.max_count()) {
+                    return false;
+                }
+                max_count_lines++;
+            }
+        }
+        matches.push_back(match);
+        if (!lists_files) {
+            return true;
+        }
+        if (!filters_matches) {
+            return false;
+        }
+        // in file scope, a kernel is done as soon as it has seen every needle it's looking for,
+        // unless an exclusion could still rule out the lines they were seen on
+        if (env.match_type() == MatchType::FileScope && !plan.has_exclusions()) {
+            Size needle_index = match.needle_index();
+            if (needle_index >= seen_literals.size()) {
+                return false;
+            }
+            if (!seen_literals[needle_index]) {
+                seen_literals[needle_index] = true;
+                seen_literal_count++;
+            }
+            return seen_literal_count < seen_literals.size();
+        }
+        return true;
+    };
 
     // do string searches
-    for (const auto &string_needle : env.string_needles()) {
-        const auto searcher = std::boyer_moore_searcher(string_needle.begin(), string_needle.end());
-        auto hit = haystack.begin();
-        while (true) {
-            auto it = std::search(hit, haystack.end(), searcher);
-            if (it == haystack.end()) {
-                break;
-            }
-            matches.emplace_back(needle_index, it - haystack.begin(), string_needle.length());
-            hit = ++it;
+    if (plan.literals().size() > 0) {
+        literal_scan(haystack, plan, add_match);
+    }
+
+    // do regex searches, which always run against the source since they fold case themselves
+    for (Size regex_index = 0; regex_index < env.regex_needles().size(); regex_index++) {
+        if (lists_files && !filters_matches && matches.size() > 0) {
+            break;
+        }
+        const auto &regex_needle = env.regex_needles()[regex_index];
+        const auto &prefilter = plan.regex_prefilters()[regex_index];
+        Kernel kernel = plan.regex_kernel(regex_index);
+        g_stats.add_kernel_use(kernel);
+        if (kernel == Kernel::MultilineRegex) {
+            multiline_regex_scan(source, prefilter, regex_needle, add_match);
+        }
+        else if (kernel == Kernel::PrefilteredRegex) {
+            prefiltered_regex_scan(source, prefilter, regex_needle, add_match);
         }
-        needle_index++;
+        else {
+            regex_scan(source, prefilter.index(), regex_needle, add_match);
+        }
+    }
+
+    // partial results from a cancelled scan aren't kept
+    if (g_limiter.is_cancelled(file_index)) {
+        g_stats.add_cancelled_file();
+        return;
     }
 
-    // do regex searches
-    for (const auto &regex_needle : env.regex_needles()) {
-        const auto searcher_begin = std::cregex_iterator(haystack.begin(), haystack.end(), regex_needle);
-        auto searcher_end = std::cregex_iterator();
-        for (auto it = searcher_begin; it != searcher_end; ++it) {
-            const auto &match = *it;                                                 
-            matches.emplace_back(needle_index, match.position(), match.length());
-        }   
-        needle_index++;
+    if (lists_files && (!filters_matches || matches.size() == 0)) {
+        list_file(matches.size() > 0);
+        return;
     }
 
     // return if nothing found
@@ -273,32 +5208,51 @@ void process_file(const fs::path &filename, const Env &env)
         return;
     }
 
-    // code below needs needles sorted by start index,
-    // but only do the work if there is more than one needle
-    Size needle_count = env.string_needles().size() + env.regex_needles().size();
-    if (needle_count > 1) {
+    // code below needs needles sorted by start index, but each kernel emits
+    // in order, so only do the work if more than one kernel ran
+    if (kernel_count > 1) {
         std::sort(matches.begin(), matches.end(), [](const Match &a, const Match &b) { 
             return a.match_start_index() < b.match_start_index(); 
         });
     }
 
-    // set line-related metadata for the match
-    std::vector<Size> haystack_line_end_offsets = UU::find_line_end_offsets(haystack, matches.back().match_start_index());
+    // a multiline match gets a ref for every line from its start line to its end line
+    if (plan.is_multiline()) {
+        split_multiline_matches(source, matches);
+    }
 
-    Size line = 0;
+    // set line-related metadata for the match, starting from the cached line starts if there are any
+    std::vector<Size> line_samples;
+    if (encoding == Encoding::UTF8 && matches.size() > 0 && g_line_tables.find(filename, env, haystack, line_samples)) {
+        g_stats.add_line_table_file();
+    }
+    LineScanner line_scanner(haystack, encoding, &line_samples);
     for (auto &match : matches) {
-        while (haystack_line_end_offsets[line] < match.match_start_index()) {
-            line++;
-            ASSERT(line < haystack_line_end_offsets.size());
-        }
-        const auto &offsets = UU::offsets_for_line(haystack, haystack_line_end_offsets, line + 1);
-        const Size sidx = offsets.first;
-        const Size eidx = offsets.second;
-        if (sidx != String::npos && eidx != String::npos) {
-            match.set_line_start_index(sidx);
-            match.set_line_length(eidx - sidx);
+        line_scanner.advance_to(match.match_start_index());
+        match.set_line_start_index(line_scanner.line_start());
+        match.set_line_length(line_scanner.line_length());
+        match.set_line(line_scanner.line());
+    }
+
+    // drop every line with a match for an exclusion, so only lines with the other needles are left to filter
+    if (plan.has_exclusions()) {
+        Size kept_count = 0;
+        Size line_start_idx = 0;
+        while (line_start_idx < matches.size()) {
+            Size line_end_idx = line_start_idx;
+            bool excluded = false;
+            while (line_end_idx < matches.size() && matches[line_end_idx].line() == matches[line_start_idx].line()) {
+                excluded = excluded || plan.is_exclusion(matches[line_end_idx].needle_index());
+                line_end_idx++;
+            }
+            if (!excluded) {
+                for (Size idx = line_start_idx; idx < line_end_idx; idx++) {
+                    matches[kept_count++] = matches[idx];
+                }
+            }
+            line_start_idx = line_end_idx;
         }
-        match.set_line(line + 1);
+        matches.resize(kept_count);
     }
 
     // if MatchType is All and there's more than one needle, 
@@ -333,9 +5287,55 @@ void process_file(const fs::path &filename, const Env &env)
         }
         matches = filtered_matches;
     }
+    else if (env.match_type() == MatchType::Within && needle_count > 1) {
+        keep_matches_within(matches, needle_count, env.within_lines());
+    }
+    else if (env.match_type() == MatchType::FileScope && needle_count > 1) {
+        std::set<Size> matched_needle_indexes;
+        for (const auto &match : matches) {
+            matched_needle_indexes.insert(match.needle_index());
+        }
+        if (matched_needle_indexes.size() < needle_count) {
+            matches.clear();
+        }
+    }
+
+    if (lists_files) {
+        list_file(matches.size() > 0);
+        return;
+    }
+
+    // return if all the matches got filtered out
+    if (matches.size() == 0) {
+        return;
+    }
+
+    // keep only the matches on the first lines up to the per-file maximum
+    if (env.max_count() > 0) {
+        Size line_count = 0;
+        Size current_line = 0;
+        auto it = std::find_if(matches.begin(), matches.end(), [&](const Match &match) {
+            if (current_line != match.line()) {
+                current_line = match.line();
+                line_count++;
+            }
+            return line_count > env.max_count();
+        });
+        matches.erase(it, matches.end());
+    }
 
-    // return if all the matches got filtered out
-    if (matches.size() == 0) {
+    // count matching lines without making any TextRefs
+    if (env.report() == Report::Count) {
+        Size count = 0;
+        Size current_line = 0;
+        for (const auto &match : matches) {
+            if (current_line != match.line()) {
+                current_line = match.line();
+                count++;
+            }
+        }
+        results.refs.emplace_back(0, filename);
+        results.count = count;
         return;
     }
 
@@ -361,19 +5361,56 @@ void process_file(const fs::path &filename, const Env &env)
     }
 
     if (env.mode() == Mode::Search) {
-        g_lock.lock();
         // add a TextRef for each match
         for (auto &match : matches) {
-            String line = String(source.substr(match.line_start_index(), match.line_length()));
+            // UTF-16 lines are decoded for output, with indexes into them moved to match
+            StringView line_source = source;
+            Size line_start = match.line_start_index();
+            Size line_length = match.line_length();
+            String decoded_line;
+            if (encoding != Encoding::UTF8) {
+                decoded_line = decode_utf16(source.substr(line_start, line_length), encoding);
+                line_source = decoded_line;
+                line_start = 0;
+                line_length = decoded_line.length();
+            }
+            auto text_index = [&](Size index) {
+                if (encoding == Encoding::UTF8) {
+                    return index;
+                }
+                return decoded_utf16_length(source.substr(match.line_start_index(), index - match.line_start_index()), encoding);
+            };
+
+            bool truncated = false;
+            String line = line_text(line_source, line_start, line_length, text_index(match.match_start_index()), 
+                max_columns, &truncated);
+
+            // count columns incrementally, since the stretches are in order along the line
+            Size column = 1;
+            Size column_index = line_start;
+            auto column_at = [&](Size index) {
+                column += count_columns(line_source.substr(column_index, index - column_index), env.column_unit());
+                column_index = index;
+                return column;
+            };
+            bool aligned = !truncated;
             Spread<Size> column_spread;
             for (const auto &match_stretch : match.spread().stretches()) {
-                Size start_column = match_stretch.first() - match.line_start_index() + 1;
-                Size end_column = match_stretch.last() - match.line_start_index() + 1;
+                Size start_column = column_at(text_index(match_stretch.first()));
+                Size end_index = text_index(match_stretch.last());
+                Size end_column = column_at(end_index);
+                aligned = aligned && end_column == end_index - line_start + 1;
                 column_spread.add(start_column, end_column);
             }
-            g_text_refs.emplace_back(0, filename, match.line(), column_spread, line);
+            if (!aligned) {
+                results.unaligned_refs.resize(matches.size());
+                results.unaligned_refs[results.refs.size()] = true;
+            }
+            results.refs.emplace_back(0, filename, match.line(), column_spread, line);
+        }
+        if (env.before_context() > 0 || env.after_context() > 0) {
+            add_context_lines(source, matches, results, max_columns, encoding, env);
         }
-        g_lock.unlock();
         return;
     }
 
@@ -381,12 +5418,17 @@ void process_file(const fs::path &filename, const Env &env)
 
     // set up a string to hold the new string after the search and replace operation
     // estimate the size by adding the length of the replacement for each match
+    // a dry run leaves the file alone, so it only needs the changed lines
+    const bool writes_file = env.mode() == Mode::SearchAndReplace;
     String output;
-    output.reserve(source.length() + (matches.size() * env.replacement().length()));
+    if (writes_file) {
+        output.reserve(bom.length() + source.length() + (matches.size() * env.replacement().length()));
+        output += bom;
+    }
     Size source_index = 0;
     String output_line;
+    std::vector<String> new_lines;
 
-    g_lock.lock();
     for (auto &match : matches) {
         // set up the source line and spread for the replacement TextRef        
         StringView source_line = StringView(source.substr(match.line_start_index(), match.line_length()));
@@ -396,18 +5438,27 @@ void process_file(const fs::path &filename, const Env &env)
         Size output_line_index = 0;
         
         for (const auto &match_stretch : match.spread().stretches()) {
+            String cased_replacement;
+            if (env.preserve_case() == PreserveCase::Yes) {
+                cased_replacement = replacement_with_case(source.substr(match_stretch.first(), match_stretch.length()), 
+                    env.replacement());
+            }
+            const String &replacement = env.preserve_case() == PreserveCase::Yes ? cased_replacement : env.replacement();
+
             // do the search and replace for the output file
-            output += source.substr(source_index, match_stretch.first() - source_index);
-            output += env.replacement();
+            if (writes_file) {
+                output += source.substr(source_index, match_stretch.first() - source_index);
+                output += replacement;
+            }
             source_index += (match_stretch.first() - source_index);
             source_index += match_stretch.length();
 
             // do the search and replace for the TextRef       
             Size start_column = match_stretch.first() - match.line_start_index();
             output_line += source_line.substr(output_line_index, start_column - output_line_index);
-            Size replacement_start_column = output_line.length() + 1;
-            output_line += env.replacement();
-            Size replacement_end_column = output_line.length() + 1;
+            Size replacement_start_column = count_columns(output_line, env.column_unit()) + 1;
+            output_line += replacement;
+            Size replacement_end_column = replacement_start_column + count_columns(replacement, env.column_unit());
             output_line_index += (start_column - output_line_index);
             output_line_index += match_stretch.length();
             output_spread.add(replacement_start_column, replacement_end_column);
@@ -416,63 +5467,372 @@ void process_file(const fs::path &filename, const Env &env)
         output_line += source_line.substr(output_line_index);
 
         // make the TextRef with the replaced text
-        g_text_refs.emplace_back(0, filename, match.line(), output_spread, output_line);
+        results.refs.emplace_back(0, filename, match.line(), output_spread, output_line);
+        if (env.report() == Report::Diff) {
+            new_lines.push_back(output_line);
+        }
     }
-    g_lock.unlock();
 
-    // append any remaining text on the output file
-    output += source.substr(source_index);
+    if (env.report() == Report::Diff) {
+        results.diff = unified_diff(source, bom, matches, new_lines, filename, env);
+    }
 
-    // write the changed file if needed
-    if (env.mode() == Mode::SearchAndReplace) {
+    // append any remaining text on the output file and write it
+    if (writes_file) {
+        output += source.substr(source_index);
         UU::write_file(filename, output);
     }
 }
 
-static void output_refs(Env &env) 
+// Writes refs to stdout as soon as a file and all the files before it have been searched,
+// so output starts right away and stays in file order. If stdout is closed, as when
+// piping to head, the rest of the search is cancelled. The refs file gets the same
+// refs with the same indexes as stdout.
+class RefsWriter
 {
-    std::sort(g_text_refs.begin(), g_text_refs.end(), std::less<TextRef>());
+public:
+    RefsWriter() {
+        const char *refs_path = getenv("REFS_PATH");
+        if (refs_path) {
+            m_refs_path = refs_path;
+        }
+    }
 
-    UU::String output(2 * 1024 * 1024);
+    bool is_output_closed() const { return m_output_closed; }
 
-    int count = 1;
-    for (auto &ref : g_text_refs) {
-        ref.set_index(count);
-        count++;
-        int flags = TextRef::HighlightMessage;
-        if (env.merge_spreads() == MergeSpreads::Yes) {
-            flags |= TextRef::CompactFeatures;
+    // Writes every file that's ready. If another thread is already writing, this leaves it
+    // a note, and that thread checks for the note after it lets go of the lock, so files
+    // that complete while it writes aren't left waiting for the next file to complete.
+    void write_completed_files(const Env &env) {
+        m_has_pending_files = true;
+        while (m_has_pending_files) {
+            std::unique_lock output_guard(m_lock, std::try_to_lock);
+            if (!output_guard.owns_lock()) {
+                return;
+            }
+            m_has_pending_files = false;
+            write_ready_files(env);
         }
-        else {
-            flags |= TextRef::ExtendedFeatures;
+    }
+
+    // Call once all searches are complete.
+    void finish(const Env &env) {
+        std::lock_guard output_guard(m_lock);
+        write_ready_files(env);
+        if (m_refs_path.empty()) {
+            return;
+        }
+        std::ofstream file(m_refs_path);
+        if (!file.fail()) {
+            file << m_refs_file_output;
+        }
+    }
+
+private:
+    void write_ready_files(const Env &env) {
+        while (!m_output_closed && !is_limit_reached()) {
+            const FileResults *results = nullptr;
+            {
+                std::lock_guard guard(g_lock);
+                if (m_next_file_index >= g_file_results.size() || !g_file_results[m_next_file_index].is_complete) {
+                    break;
+                }
+                results = &g_file_results[m_next_file_index];
+            }
+            m_next_file_index++;
+            add_refs(*results, env);
+        }
+        if (m_output.length() > 0 && !m_output_closed) {
+            std::cout << m_output << std::flush;
+            if (std::cout.fail()) {
+                // nothing more can be shown, so searches stop, but replacements carry on to
+                // every file, since stopping partway would leave the tree half changed
+                m_output_closed = true;
+                if (env.mode() != Mode::SearchAndReplace) {
+                    g_limiter.cancel();
+                }
+            }
+        }
+        m_output.clear();
+    }
+
+    bool is_limit_reached() const {
+        return g_limiter.has_limit() && m_ref_count >= g_limiter.limit();
+    }
+
+    void add_refs(const FileResults &results, const Env &env) {
+        int flags = TextRef::Index | TextRef::Filename;
+        int refs_file_flags = TextRef::Index | TextRef::Filename;
+        if (env.report() == Report::Lines) {
+            flags = TextRef::HighlightMessage;
+            if (env.merge_spreads() == MergeSpreads::Yes) {
+                flags |= TextRef::CompactFeatures;
+            }
+            else {
+                flags |= TextRef::ExtendedFeatures;
+            }
+            refs_file_flags = TextRef::StandardFeatures;
         }
         int highlight_color_value = static_cast<int>(env.highlight_color());
-        ref.write_to_string(output, flags, env.filename_format(), env.current_path(), highlight_color_value);
-        output += '\n';
+
+        // a diff covers the whole file, and takes the place of its refs on stdout
+        bool writes_refs = env.report() != Report::Diff;
+        if (!writes_refs) {
+            m_output += results.diff;
+        }
+
+        for (Size idx = 0; idx < results.refs.size(); idx++) {
+            if (is_limit_reached()) {
+                break;
+            }
+            const RefContext *context = idx < results.contexts.size() ? &results.contexts[idx] : nullptr;
+            if (context) {
+                if (context->starts_group && m_ref_count > 0) {
+                    m_output += "--\n";
+                }
+                add_context_lines(results.filename, context->before, env);
+            }
+            m_ref_count++;
+            TextRef ref(results.refs[idx]);
+            ref.set_index(int(m_ref_count));
+            // a truncated line, or one with multibyte characters before the match, no longer
+            // lines up byte for byte with the ref's columns, so it can't be highlighted
+            int ref_flags = flags;
+            if (idx < results.unaligned_refs.size() && results.unaligned_refs[idx]) {
+                ref_flags &= ~TextRef::HighlightMessage;
+            }
+            if (writes_refs) {
+                ref.write_to_string(m_output, ref_flags, env.filename_format(), env.current_path(), highlight_color_value);
+                if (env.report() == Report::Count) {
+                    m_output += ": ";
+                    m_output += std::to_string(results.count);
+                }
+                else if (env.report() == Report::Offsets) {
+                    add_offset(results.offsets[idx], env);
+                }
+                m_output += '\n';
+            }
+            if (!m_refs_path.empty()) {
+                ref.write_to_string(m_refs_file_output, refs_file_flags, TextRef::FilenameFormat::ABSOLUTE);
+                m_refs_file_output += '\n';
+            }
+            if (context) {
+                add_context_lines(results.filename, context->after, env);
+            }
+        }
     }
-    std::cout << output;
 
-    const char *refs_path = getenv("REFS_PATH");
-    if (refs_path) {
-        output.clear();
-        std::ofstream file(refs_path);
-        if (!file.fail()) {
-            count = 1;
-            for (auto &ref : g_text_refs) {
-                ref.set_index(count);
-                count++;
-                ref.write_to_string(output, TextRef::StandardFeatures, TextRef::FilenameFormat::ABSOLUTE);
-                output += '\n';
+    // written after the filename as the offset in hex, then the bytes found there
+    void add_offset(const ByteOffset &offset, const Env &env) {
+        char hex[24];
+        snprintf(hex, sizeof(hex), ": 0x%llx: ", (unsigned long long)offset.offset);
+        m_output += hex;
+        for (unsigned char c : env.string_needles()[offset.needle_index]) {
+            snprintf(hex, sizeof(hex), "%02x", c);
+            m_output += hex;
+        }
+    }
+
+    // context lines aren't refs, so they are written in grep style without an index
+    void add_context_lines(const fs::path &filename, const std::vector<ContextLine> &lines, const Env &env) {
+        if (lines.size() == 0) {
+            return;
+        }
+        String formatted_filename;
+        switch (env.filename_format()) {
+            case TextRef::FilenameFormat::ABSOLUTE:
+                formatted_filename = String(filename);
+                break;
+            case TextRef::FilenameFormat::RELATIVE:
+                formatted_filename = String(fs::relative(filename, env.current_path()));
+                break;
+            case TextRef::FilenameFormat::TERSE:
+                formatted_filename = String(filename.filename());
+                break;
+        }
+        for (const auto &context_line : lines) {
+            m_output += formatted_filename;
+            m_output += '-';
+            m_output += std::to_string(context_line.line);
+            m_output += '-';
+            m_output += context_line.text;
+            m_output += '\n';
+        }
+    }
+
+    std::mutex m_lock;
+    fs::path m_refs_path;
+    Size m_next_file_index = 0;
+    std::atomic_bool m_has_pending_files = false;
+    Size m_ref_count = 0;
+    String m_output;
+    String m_refs_file_output;
+    bool m_output_closed = false;
+};
+
+RefsWriter g_refs_writer;
+
+static bool file_has_match(const FileResults &results, const Env &env)
+{
+    switch (env.report()) {
+        case Report::FilesWithoutMatch:
+            return results.refs.empty();
+        case Report::Count:
+            return results.count > 0;
+        default:
+            return !results.refs.empty() || !results.offsets.empty();
+    }
+}
+
+static void search_file(Size file_index, FileResults &results, const Env &env)
+{
+    {
+#if !USE_DISPATCH
+        // The guard releases the semaphore regardless of how the block exits
+        UU::AcquireReleaseGuard semaphore_guard(g_semaphore);
+#endif
+
+        if (g_limiter.is_cancelled(file_index)) {
+            g_stats.add_cancelled_file();
+        }
+        else {
+            process_file(file_index, results, env);
+            if (results.passed_filter) {
+                g_file_filters.add_checked_file(file_has_match(results, env));
             }
-            file << output;
-        } 
+        }
+
+        std::lock_guard guard(g_lock);
+        results.is_complete = true;
+        g_limiter.file_completed(file_index, results.refs.size());
+    }
+
+    // write output outside the semaphore, so a slow reader doesn't hold up searching
+    g_refs_writer.write_completed_files(env);
+}
+
+static void output_refs(Env &env) 
+{
+    g_refs_writer.finish(env);
+    if (g_refs_writer.is_output_closed()) {
+        return;
     }
 
     UU::time_check_done(5);
-    std::cout << "time: " << UU::time_check_elapsed_seconds(5) << std::endl;
+    if (env.show_stats() == ShowStats::Yes) {
+        std::cout << g_stats.to_string(env.plan()) << std::endl;
+        if (g_index_filter.has_index()) {
+            std::cout << g_index_filter.to_string() << std::endl;
+        }
+        if (g_file_filters.is_active()) {
+            std::cout << g_file_filters.to_string() << std::endl;
+        }
+    }
+    // a diff is meant to be piped to git apply or patch, so it gets nothing after it
+    if (env.report() != Report::Diff) {
+        std::cout << "time: " << UU::time_check_elapsed_seconds(5) << std::endl;
+    }
     // std::cout << UU::Context::get().allocator().stats() << std::endl;
 }
 
+// Writes a ref for each definition of the name, from the definitions index. A file that's
+// changed since the index was built is read again for its definitions, so its refs are
+// still right, though definitions added to files that didn't have one before need a rebuild.
+static int find_definitions(Env &env)
+{
+    DefinitionIndex index;
+    if (!index.load(env.current_path() / DefsFilename)) {
+        std::cerr << "*** search: no definitions index in " << env.current_path() << "; use --build-defs to make one" << std::endl;
+        return -1;
+    }
+    const String &name = env.string_needles()[0];
+    auto name_matches = [&](StringView def_name) {
+        if (env.search_case() == SearchCase::Sensitive) {
+            return def_name == name;
+        }
+        return def_name.length() == name.length() && std::equal(def_name.begin(), def_name.end(), name.begin(), 
+            [](char x, char y) { return tolower((unsigned char)x) == tolower((unsigned char)y); });
+    };
+
+    // the index's definitions of the name, by file
+    std::map<UInt32, std::vector<Definition>> indexed_defs;
+    for (Size idx : index.find(name, env.search_case())) {
+        const DefEntry &def = index.def(idx);
+        indexed_defs[def.file_id].push_back({ std::string(index.name(def)), def.line, def.column, def.line_start });
+    }
+
+    // files that changed or were added since the index was built are read again, so none are missed
+    for (const auto &path : walk_index_paths(env)) {
+        const fs::path filename = env.current_path() / path;
+        DefLanguage language = def_language(filename);
+        if (language == DefLanguage::None) {
+            continue;
+        }
+        Size id = index.files().find(path);
+        bool is_current = id != String::npos && index.files().is_current(UInt32(id), filename);
+        auto indexed = is_current ? indexed_defs.find(UInt32(id)) : indexed_defs.end();
+        if (is_current && indexed == indexed_defs.end()) {
+            continue;
+        }
+
+        MappedFile mapped_file(filename);
+        if (mapped_file.is_valid<false>()) {
+            continue;
+        }
+        StringView source((char *)mapped_file.base(), mapped_file.file_length());
+        Size bom_length = 0;
+        if (sniff_encoding(source, bom_length) != Encoding::UTF8) {
+            continue;
+        }
+        source = source.substr(bom_length);
+        std::vector<Definition> defs;
+        if (is_current) {
+            defs = std::move(indexed->second);
+        }
+        else {
+            for (auto &def : find_definitions_in_file(source, language)) {
+                if (name_matches(def.name)) {
+                    defs.push_back(std::move(def));
+                }
+            }
+        }
+        if (defs.empty()) {
+            continue;
+        }
+
+        FileResults &results = g_file_results.emplace_back();
+        results.filename = filename;
+        for (const auto &def : defs) {
+            // a definition that doesn't land in the file is left out
+            if (def.line_start > source.length() || def.column == 0) {
+                continue;
+            }
+            Size line_end = find_newline(source, def.line_start, Encoding::UTF8);
+            if (def.column - 1 > line_end - def.line_start) {
+                continue;
+            }
+            Size line_length = line_end - def.line_start;
+            if (line_length > 0 && source[line_end - 1] == '\r') {
+                line_length--;
+            }
+            bool truncated = false;
+            String line = line_text(source, def.line_start, line_length, def.line_start + def.column - 1, env.max_columns(),
+                &truncated);
+            // the definitions hold byte columns, which are counted again in the unit the other refs use
+            Size column = 1 + count_columns(source.substr(def.line_start, def.column - 1), env.column_unit());
+            Size end_column = column + count_columns(def.name, env.column_unit());
+            if (truncated || column != def.column || end_column != def.column + def.name.length()) {
+                results.unaligned_refs.resize(defs.size());
+                results.unaligned_refs[results.refs.size()] = true;
+            }
+            results.refs.emplace_back(0, filename, def.line, Spread<Size>(column, end_column), line);
+        }
+        results.is_complete = true;
+    }
+    output_refs(env);
+    return 0;
+}
+
 static void version(void)
 {
     puts("search : version 4.0");
@@ -485,27 +5845,126 @@ static void usage(void)
     puts("Usage: search [options] <search-string>...");
     puts("");
     puts("Options:");
+    puts("    -A <n> : Prints <n> lines of context after each result.");
+    puts("    -B <n> : Prints <n> lines of context before each result.");
+    puts("    -C <n> : Prints <n> lines of context before and after each result.");
     puts("    -a : Search all files in all directories not skipped (see -s option),");
-    puts("             i.e., not just those listed in ENV['SEARCHABLES'].");
+    puts("             i.e., not just those listed in ENV['SEARCHABLES']. Also searches binary files.");
     puts("    -c <color>: Highlights results with the given color. Implies output to a terminal.");
     puts("                colors: black, gray, red, green, yellow, blue, magenta, cyan, white");
     puts(" ");
     puts("    -e : Search needles are compiles as regular expressions.");
     puts("    -h : Prints this help message.");
-    puts("    -i : Case insensitive search.");
+    puts("    -i : Case insensitive search. String needles fold case for Unicode text too.");
     puts("    -l : Show each found result on its own line.");
     puts("    -n : Search and replace dry run. Don't change any files. Ignored if not run with -r");
     puts("    -r : Search and replace. Takes two arguments: <search> <replacement>");
     puts("             <search> can be a string or a regex (when invoked with -e)");
     puts("             <replacement> is always treated as a string");
+    puts("    --preserve-case : With -r, matches case-insensitively and gives each replacement the case of the");
+    puts("             text it replaces: widget, Widget and WIDGET become gadget, Gadget and GADGET.");
+    puts("    --diff : With -r, prints a unified diff of the changes instead of making them, for git apply or patch.");
+    puts("             Hunks get 3 lines of context, or as many as -A, -B, or -C give.");
     puts("    -s : Search for files in all directories, including those in ENV['SKIPPABLES_PATH'].");
     puts("    -t : Print filenames in terse format (filename only; no preceding path).");
+    puts("    -U : Multiline search. Implies -e, with needles in ECMAScript syntax so they can match across");
+    puts("             lines: \\n matches a newline, and ^ and $ match at the start and end of each line.");
+    puts("             Each match gets a result for every line it spans, up to 64 lines.");
     puts("    -v : Prints the program version.");
     puts("    -y : Matches any needle given, rather than requiring a line to match all needles.");
+    puts("    --within <n> : Requires all needles to be found within <n> lines of each other, rather than on one line.");
+    puts("    --file-scope : Requires all needles to be found somewhere in the file, rather than on one line.");
+    puts("    --not <string> : Leaves out lines that contain <string>. Can be given more than once.");
+    puts("    --count : Prints the number of matching lines in each file with matches.");
+    puts("    --files-with-matches : Prints only the names of files with matches.");
+    puts("    --files-without-match : Prints only the names of files without matches.");
+    puts("    --columns <unit> : Counts result columns in the given unit (default: codepoints).");
+    puts("                units: bytes, codepoints, utf16");
+    puts("    --max-columns <n> : Prints at most <n> bytes of each line, around the match.");
+    puts("    --skip-minified : Skips files that look minified or generated, judging by line length.");
+    puts("             Otherwise results in those files are printed with a column limit. Ignored with -r.");
+    puts("    --max-count <n> : Stops searching each file after <n> matching lines, or <n> matches with --hex.");
+    puts("    --limit <n> : Stops the search after <n> results, keeping the first results in file order.");
+    puts("    --fastest : With --limit, keeps whichever <n> results are found first instead.");
+    puts("    --hex <bytes> : Searches for the given bytes, like DEADBEEF, instead of a search string.");
+    puts("             Can be given more than once. Prints the offset of each match instead of lines,");
+    puts("             and searches binary files too.");
+    puts("    --build-index : Indexes the trigrams of the files under the current directory, for later searches");
+    puts("             started there to skip files that can't match. Files changed since are still searched.");
+    puts("    --build-filters : Writes a Bloom filter of the trigrams of each file under the current directory,");
+    puts("             a lighter alternative to --build-index that later searches use the same way.");
+    puts("    --line-tables : With --build-index or --build-filters, also caches where lines start in each file,");
+    puts("             so later searches can number the lines of matches without scanning the lines before them.");
+    puts("    --build-defs : Indexes where names are defined in C, C++, Python, Go, and JavaScript files under the");
+    puts("             current directory. Files that haven't changed since the last build aren't read again.");
+    puts("    --def : Prints the definitions of the name given as the search string, from the definitions index.");
+    puts("    --no-index : Searches every file, even with an index or filters.");
+    puts("    --stats : Prints the query plan and search statistics.");
+}
+
+enum {
+    OptionStats = 256,
+    OptionCount,
+    OptionFilesWithMatches,
+    OptionFilesWithoutMatch,
+    OptionMaxCount,
+    OptionLimit,
+    OptionFastest,
+    OptionMaxColumns,
+    OptionSkipMinified,
+    OptionColumns,
+    OptionHex,
+    OptionWithin,
+    OptionFileScope,
+    OptionNot,
+    OptionPreserveCase,
+    OptionDiff,
+    OptionBuildIndex,
+    OptionBuildFilters,
+    OptionLineTables,
+    OptionBuildDefs,
+    OptionDef,
+    OptionNoIndex,
+};
+
+static Size count_from_option(const char *option_name, const char *arg)
+{
+    char *end = nullptr;
+    long long value = strtoll(arg, &end, 10);
+    if (end == arg || *end != '\0' || value <= 0) {
+        usage();
+        std::cout << "\n*** " << option_name << " takes a positive number: " << arg << std::endl;
+        exit(-1);
+    }
+    return value;
+}
+
+// Converts a string of hex digit pairs, with an optional 0x prefix, to the bytes they spell
+static bool bytes_from_hex(const char *hex, String &bytes)
+{
+    if (hex[0] == '0' && (hex[1] == 'x' || hex[1] == 'X')) {
+        hex += 2;
+    }
+    Size length = strlen(hex);
+    if (length == 0 || length % 2 != 0) {
+        return false;
+    }
+    bytes.clear();
+    for (Size idx = 0; idx < length; idx += 2) {
+        if (!isxdigit((unsigned char)hex[idx]) || !isxdigit((unsigned char)hex[idx + 1])) {
+            return false;
+        }
+        char digits[3] = { hex[idx], hex[idx + 1], '\0' };
+        bytes += (char)strtol(digits, nullptr, 16);
+    }
+    return true;
 }
 
 static struct option long_options[] =
 {
+    {"after-context",     required_argument, 0, 'A'},
+    {"before-context",    required_argument, 0, 'B'},
+    {"context",           required_argument, 0, 'C'},
     {"all-files",         no_argument,       0, 'a'},
     {"highlight-color",   required_argument, 0, 'c'},
     {"regex-search",      no_argument,       0, 'e'},
@@ -516,8 +5975,31 @@ static struct option long_options[] =
     {"replace",           no_argument,       0, 'r'},
     {"search-skippables", no_argument,       0, 's'},
     {"terse",             no_argument,       0, 't'},
+    {"multiline",         no_argument,       0, 'U'},
     {"version",           no_argument,       0, 'v'},
     {"any-needle",        no_argument,       0, 'y'},
+    {"stats",             no_argument,       0, OptionStats},
+    {"count",             no_argument,       0, OptionCount},
+    {"files-with-matches", no_argument,      0, OptionFilesWithMatches},
+    {"files-without-match", no_argument,     0, OptionFilesWithoutMatch},
+    {"max-count",         required_argument, 0, OptionMaxCount},
+    {"limit",             required_argument, 0, OptionLimit},
+    {"fastest",           no_argument,       0, OptionFastest},
+    {"max-columns",       required_argument, 0, OptionMaxColumns},
+    {"skip-minified",     no_argument,       0, OptionSkipMinified},
+    {"columns",           required_argument, 0, OptionColumns},
+    {"hex",               required_argument, 0, OptionHex},
+    {"within",            required_argument, 0, OptionWithin},
+    {"file-scope",        no_argument,       0, OptionFileScope},
+    {"not",               required_argument, 0, OptionNot},
+    {"preserve-case",     no_argument,       0, OptionPreserveCase},
+    {"diff",              no_argument,       0, OptionDiff},
+    {"build-index",       no_argument,       0, OptionBuildIndex},
+    {"build-filters",     no_argument,       0, OptionBuildFilters},
+    {"line-tables",       no_argument,       0, OptionLineTables},
+    {"build-defs",        no_argument,       0, OptionBuildDefs},
+    {"def",               no_argument,       0, OptionDef},
+    {"no-index",          no_argument,       0, OptionNoIndex},
     {0, 0, 0, 0}
 };
 
@@ -528,6 +6010,9 @@ int main(int argc, char **argv)
     LOG_CHANNEL_ON(General);
     LOG_CHANNEL_ON(Memory);
 
+    // a closed stdout shows up as a failed write, which cancels the search
+    signal(SIGPIPE, SIG_IGN);
+
     bool option_a = false;
     bool option_e = false;
     bool option_i = false;
@@ -536,17 +6021,52 @@ int main(int argc, char **argv)
     bool option_r = false;
     bool option_s = false;
     bool option_t = false;
+    bool option_U = false;
     bool option_y = false;
+    bool option_stats = false;
+    Report report = Report::Lines;
+    Size max_count = 0;
+    Size limit = 0;
+    LimitOrder limit_order = LimitOrder::FileOrder;
+    Size before_context = 0;
+    Size after_context = 0;
+    Size max_columns = 0;
+    SkipMinified skip_minified = SkipMinified::No;
+    String option_columns;
+    std::vector<String> hex_needles;
+    Size within_lines = 0;
+    bool option_file_scope = false;
+    std::vector<String> exclusion_needles;
+    bool option_preserve_case = false;
+    bool option_context = false;
+    bool option_build_index = false;
+    bool option_build_filters = false;
+    bool option_line_tables = false;
+    bool option_build_defs = false;
+    bool option_def = false;
+    bool option_no_index = false;
 
     String option_c;
 
     while (1) {
         int option_index = 0;
-        int c = getopt_long(argc, argv, "ac:ehilnrstvy", long_options, &option_index);
+        int c = getopt_long(argc, argv, "A:B:C:Uac:ehilnrstvy", long_options, &option_index);
         if (c == -1)
             break;
     
         switch (c) {
+            case 'A':
+                after_context = count_from_option("-A", optarg);
+                option_context = true;
+                break;
+            case 'B':
+                before_context = count_from_option("-B", optarg);
+                option_context = true;
+                break;
+            case 'C':
+                before_context = after_context = count_from_option("-C", optarg);
+                option_context = true;
+                break;
             case 'a':
                 option_a = true;
                 break;
@@ -577,12 +6097,91 @@ int main(int argc, char **argv)
             case 't':
                 option_t = true;
                 break;
+            case 'U':
+                option_U = true;
+                option_e = true;
+                break;
             case 'v':
                 version();
                 return 0;            
             case 'y':
                 option_y = true;
                 break;
+            case OptionStats:
+                option_stats = true;
+                break;
+            case OptionCount:
+                report = Report::Count;
+                break;
+            case OptionFilesWithMatches:
+                report = Report::FilesWithMatches;
+                break;
+            case OptionFilesWithoutMatch:
+                report = Report::FilesWithoutMatch;
+                break;
+            case OptionMaxCount:
+                max_count = count_from_option("--max-count", optarg);
+                break;
+            case OptionLimit:
+                limit = count_from_option("--limit", optarg);
+                break;
+            case OptionFastest:
+                limit_order = LimitOrder::Fastest;
+                break;
+            case OptionMaxColumns:
+                max_columns = count_from_option("--max-columns", optarg);
+                break;
+            case OptionSkipMinified:
+                skip_minified = SkipMinified::Yes;
+                break;
+            case OptionColumns:
+                option_columns = String(optarg);
+                break;
+            case OptionWithin:
+                within_lines = count_from_option("--within", optarg);
+                break;
+            case OptionFileScope:
+                option_file_scope = true;
+                break;
+            case OptionNot:
+                exclusion_needles.emplace_back(optarg);
+                break;
+            case OptionPreserveCase:
+                option_preserve_case = true;
+                option_i = true;
+                break;
+            case OptionDiff:
+                report = Report::Diff;
+                option_n = true;
+                break;
+            case OptionBuildIndex:
+                option_build_index = true;
+                break;
+            case OptionBuildFilters:
+                option_build_filters = true;
+                break;
+            case OptionLineTables:
+                option_line_tables = true;
+                break;
+            case OptionBuildDefs:
+                option_build_defs = true;
+                break;
+            case OptionDef:
+                option_def = true;
+                break;
+            case OptionNoIndex:
+                option_no_index = true;
+                break;
+            case OptionHex: {
+                String bytes;
+                if (!bytes_from_hex(optarg, bytes)) {
+                    usage();
+                    std::cout << "\n*** --hex takes pairs of hex digits: " << optarg << std::endl;
+                    exit(-1);
+                }
+                hex_needles.push_back(bytes);
+                break;
+            }
             case '?':
                 version();
                 return 0;            
@@ -593,14 +6192,31 @@ int main(int argc, char **argv)
         }
     }
 
-    if (optind >= argc) {
+    if (optind >= argc && hex_needles.empty() && !option_build_index && !option_build_filters && !option_build_defs) {
         usage();
         exit(-1);
     }
+
+    NeedleFormat needle_format = hex_needles.empty() ? NeedleFormat::Text : NeedleFormat::Hex;
+    if (needle_format == NeedleFormat::Hex) {
+        if (optind < argc || option_e || option_i || option_r || exclusion_needles.size() > 0) {
+            usage();
+            puts("");
+            puts("*** --hex can't be combined with search strings, -e, -i, -r, -U, or --not");
+            exit(-1);
+        }
+        if (report == Report::Lines) {
+            report = Report::Offsets;
+        }
+    }
     
-    std::vector<String> string_needles;
+    std::vector<String> string_needles = hex_needles;
     std::vector<std::regex> regex_needles;
+    std::vector<String> regex_patterns;
     std::regex::flag_type regex_flags = std::regex::egrep | std::regex::optimize;
+    if (option_U) {
+        regex_flags = std::regex::ECMAScript | std::regex::multiline | std::regex::optimize;
+    }
     if (option_i) {
         regex_flags |= std::regex::icase;
     }
@@ -616,37 +6232,108 @@ int main(int argc, char **argv)
             exit(-1);
         }
         replacement = argv[argc - 1];        
+        if (report != Report::Lines && report != Report::Diff) {
+            usage();
+            puts("");
+            puts("*** search and replace can't be combined with --count, --files-with-matches, or --files-without-match");
+            exit(-1);
+        }
+        if (max_count > 0 || limit > 0) {
+            usage();
+            puts("");
+            puts("*** search and replace can't be combined with --max-count or --limit");
+            exit(-1);
+        }
+        if (option_U) {
+            usage();
+            puts("");
+            puts("*** search and replace can't be combined with -U");
+            exit(-1);
+        }
+    }
+    else if (option_preserve_case || report == Report::Diff) {
+        usage();
+        puts("");
+        puts("*** --preserve-case and --diff only apply to search and replace");
+        exit(-1);
+    }
+
+    if (option_def && (argc - optind != 1 || option_e || option_r || needle_format == NeedleFormat::Hex || 
+        exclusion_needles.size() > 0)) {
+        usage();
+        puts("");
+        puts("*** --def takes a single name, and can't be combined with -e, -r, --hex, or --not");
+        exit(-1);
+    }
+
+    if (option_line_tables && !option_build_index && !option_build_filters) {
+        usage();
+        puts("");
+        puts("*** --line-tables only applies to --build-index or --build-filters");
+        exit(-1);
+    }
+
+    // diffs get the usual three lines of context unless asked for something else
+    if (report == Report::Diff && !option_context) {
+        before_context = after_context = DiffContextLines;
     }    
 
     for (int i = optind; i < needle_count; i++) {
         const char *arg = argv[i];
         if (option_e) {
             regex_needles.emplace_back(arg, regex_flags);
+            regex_patterns.emplace_back(arg);
         }
         else {
             String needle(arg);
             if (option_i) {
-                std::transform(needle.cbegin(), needle.cend(), needle.begin(), [](unsigned char c) { return std::tolower(c); });    
+                needle = fold_case(needle, true);
             }
             string_needles.push_back(needle);
         }
     }
     
+    if (option_i) {
+        for (auto &exclusion_needle : exclusion_needles) {
+            exclusion_needle = fold_case(exclusion_needle, true);
+        }
+    }
+    
     SearchCase search_case = option_i ? SearchCase::Insensitive : SearchCase::Sensitive;
-    MatchType match_type = option_y ? MatchType::Any : MatchType::All;
+    if ((option_y ? 1 : 0) + (within_lines > 0 ? 1 : 0) + (option_file_scope ? 1 : 0) > 1) {
+        usage();
+        puts("");
+        puts("*** only one of -y, --within, and --file-scope can be given");
+        exit(-1);
+    }
+
+    // every byte match stands alone, since there are no lines for needles to share
+    MatchType match_type = MatchType::All;
+    if (option_y || needle_format == NeedleFormat::Hex) {
+        match_type = MatchType::Any;
+    }
+    else if (within_lines > 0) {
+        match_type = MatchType::Within;
+    }
+    else if (option_file_scope) {
+        match_type = MatchType::FileScope;
+    }
     Mode mode = Mode::Search;
     if (option_r) {
         mode = Mode::SearchAndReplace;
         if (option_n) {
             mode = Mode::SearchAndReplaceDryRun;
         }
+        // a replacement changes every file with a match, so skipping some would quietly leave them unchanged
+        skip_minified = SkipMinified::No;
     }
     TextRef::FilenameFormat filename_format = TextRef::FilenameFormat::RELATIVE;
     if (option_t) {
         filename_format = TextRef::FilenameFormat::TERSE;
     }
     HighlightColor highlight_color = HighlightColor::None;
-    MergeSpreads merge_spreads = option_l ? MergeSpreads::No : MergeSpreads::Yes;
+    // a diff needs every change on a line in one place
+    MergeSpreads merge_spreads = option_l && report != Report::Diff ? MergeSpreads::No : MergeSpreads::Yes;
     if (option_c.length() > 0) {
         highlight_color = highlight_color_from_string(option_c);
         if (highlight_color == HighlightColor::None) {
@@ -656,58 +6343,125 @@ int main(int argc, char **argv)
         }
     }
 
+    ColumnUnit column_unit = ColumnUnit::Codepoints;
+    if (option_columns.length() > 0) {
+        std::map<String, ColumnUnit> column_units = {
+            {"bytes", ColumnUnit::Bytes},
+            {"codepoints", ColumnUnit::Codepoints},
+            {"utf16", ColumnUnit::UTF16},
+        };
+        const auto r = column_units.find(option_columns);
+        if (r == column_units.end()) {
+            usage();
+            std::cout << "\n*** unsupported column unit: " << option_columns << std::endl;
+            exit(-1);
+        }
+        column_unit = r->second;
+    }
+
     Skip skip = option_s ? Skip::SkipNone : Skip::SkipSkippables;
     LimitToSearchables limit_to_searchables = option_a ? LimitToSearchables::No : LimitToSearchables::Yes;
+    ShowStats show_stats = option_stats ? ShowStats::Yes : ShowStats::No;
+
+    QueryPlan plan(string_needles, regex_patterns, exclusion_needles, search_case, option_U ? Multiline::Yes : Multiline::No);
 
     __block Env env(fs::current_path(),
             string_needles,
             regex_needles,
+            plan,
             replacement,
+            option_preserve_case ? PreserveCase::Yes : PreserveCase::No,
             filename_format,
             highlight_color,
             match_type,
+            within_lines,
             merge_spreads,
             mode,
+            report,
+            needle_format,
+            max_count,
+            before_context,
+            after_context,
+            max_columns,
+            skip_minified,
+            column_unit,
             search_case,
             skip,
-            limit_to_searchables);
+            limit_to_searchables,
+            show_stats);
+
+    if (option_build_defs) {
+        return build_definitions(env);
+    }
+    if (option_def) {
+        return find_definitions(env);
+    }
+    if (option_build_index || option_build_filters) {
+        int result = option_build_index ? build_index(env) : build_filters(env);
+        if (result == 0 && option_line_tables) {
+            result = build_line_tables(env);
+        }
+        return result;
+    }
+
+    g_limiter.set_limit(limit, limit_order);
+    if (!option_no_index) {
+        g_index_filter.prepare(env);
+        g_file_filters.prepare(env);
+        g_line_tables.prepare(env);
+    }
+    if (g_index_filter.is_large_search()) {
+        std::cerr << "search: " << g_index_filter.estimate_string() << std::endl;
+    }
 
     fs::path current_path = fs::current_path();
-    const auto &files = build_file_list(env, current_path);
+    const Env *env_ptr = &env;
 
 #if USE_DISPATCH
-    __block int completions = 0;
-
-    for (const auto &filename : files) {
-        dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_HIGH, 0), ^{
-            process_file(filename, env);
-            g_lock.lock();
-            completions++;
-            if (completions == files.size()) {
-                output_refs(env);
-                exit(0);
-            }
-            g_lock.unlock();
+    dispatch_group_t group = dispatch_group_create();
+    dispatch_queue_t queue = dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_HIGH, 0);
+#else
+    std::vector<std::future<void>> futures;
+#endif
+
+    // start searching each file as soon as the walk finds it, and stop
+    // walking once the limit cancels files that haven't been found yet
+    walk_files(env, current_path, [&](const fs::path &filename) {
+        if (is_index_file(filename)) {
+            return true;
+        }
+        FileResults *results = nullptr;
+        Size file_index = 0;
+        {
+            std::lock_guard guard(g_lock);
+            file_index = g_file_results.size();
+            if (g_limiter.is_cancelled(file_index)) {
+                return false;
+            }
+            results = &g_file_results.emplace_back();
+            results->filename = filename;
+            g_limiter.add_file();
+        }
+#if USE_DISPATCH
+        dispatch_group_async(group, queue, ^{
+            search_file(file_index, *results, *env_ptr);
         });
-    }
+#else
+        futures.push_back(std::async(std::launch::async, search_file, file_index, std::ref(*results), std::cref(*env_ptr)));
+#endif
+        return true;
+    });
 
-    dispatch_main();
+    // wait for every search to finish before writing output
+#if USE_DISPATCH
+    dispatch_group_wait(group, DISPATCH_TIME_FOREVER);
 #else
-    std::vector<std::future<void>> futures;
-    futures.reserve(files.size());
-    for (const auto &filename : files) {
-        auto a = std::async(std::launch::async, process_file, filename, env);
-        futures.push_back(std::move(a));
+    for (auto &f : futures) {
+        f.wait();
     }
-
-    // std::vector<TextRef> text_refs;
-    // for (auto &f :futures) {
-    //     std::vector<TextRef> file_refs = f.get();
-    //     text_refs.insert(text_refs.cend(), file_refs.begin(), file_refs.end());
-    // }
+#endif
 
     output_refs(env);
-#endif
 
     return 0;
 }